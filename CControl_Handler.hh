@@ -15,6 +15,7 @@ public:
   virtual ~CControl_Handler();
 
   virtual void StatusUpdate(mongocxx::collection*);
+  virtual void SampleCounters() {}
   virtual int Arm(std::shared_ptr<Options>&);
   virtual int Start();
   virtual int Stop();
@@ -0,0 +1,155 @@
+#include "ChunkSchedule.hh"
+#include "MongoLog.hh"
+#include "Options.hh"
+#include <fcntl.h>
+#include <unistd.h>
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+#include <stdexcept>
+
+// 2^22 chunks of at least a second each is more than a month
+static const int kMaxChunks = 1 << 22;
+// How far the leader publishes past the newest data: followers only look
+// every so often and their data can be a bit ahead of ours
+static const int kChunksAhead = 3;
+static const int64_t kTimeAhead = 5000000000l; // ns
+static const int kMaxAppend = 1000; // per call, in case the newest time is garbage
+
+ChunkSchedule::ChunkSchedule(int64_t length) {
+  fAdaptive = fLeader = false;
+  fLength = fMinLength = fMaxLength = length;
+  fOverlap = fTarget = 0;
+  fCount = 0;
+  fFD = -1;
+  fReadPos = 0;
+  fLastRefresh = 0;
+  fMeasured = 0;
+  fMark = 0;
+  fMarkBytes = 0;
+  fRate = 0;
+}
+
+ChunkSchedule::ChunkSchedule(std::shared_ptr<Options>& options, std::shared_ptr<MongoLog>& log,
+    const std::string& run_dir, bool leader) : ChunkSchedule(0) {
+  fAdaptive = true;
+  fLeader = leader;
+  fLog = log;
+  fOverlap = long(options->GetDouble("strax_chunk_overlap", 0.5)*1e9);
+  fMinLength = long(options->GetDouble("strax_chunk_min_length", 1)*1e9) + fOverlap;
+  fMaxLength = long(options->GetDouble("strax_chunk_max_length", 60)*1e9) + fOverlap;
+  fMaxLength = std::max(fMaxLength, fMinLength);
+  fLength = std::clamp<int64_t>(long(options->GetDouble("strax_chunk_length", 5)*1e9) + fOverlap,
+      fMinLength, fMaxLength);
+  fTarget = options->GetInt("strax_chunk_target_size", 500)*1000000l;
+  fEnds.reset(new std::atomic<int64_t>[kMaxChunks]); // untouched pages cost nothing
+  fFileName = run_dir + "/chunk_boundaries";
+  if (fLeader) {
+    fFD = open(fFileName.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_APPEND | O_CLOEXEC, 0644);
+    if (fFD < 0)
+      throw std::runtime_error("Can't write " + fFileName + ": " + std::strerror(errno));
+    Extend(0, 0, 0);
+  }
+}
+
+ChunkSchedule::~ChunkSchedule() {
+  if (fFD >= 0) close(fFD);
+}
+
+int ChunkSchedule::ChunkOf(int64_t t) {
+  if (!fAdaptive) return t/fLength;
+  int n = fCount.load(std::memory_order_acquire);
+  int c = Complete(t);
+  return c < n ? c : -1;
+}
+
+int64_t ChunkSchedule::End(int chunk) {
+  if (!fAdaptive) return (chunk+1)*fLength;
+  if (chunk < fCount.load(std::memory_order_acquire))
+    return fEnds[chunk].load(std::memory_order_relaxed);
+  return INT64_MAX;
+}
+
+int ChunkSchedule::Complete(int64_t t) {
+  if (!fAdaptive) return t < 0 ? 0 : t/fLength;
+  // first end that's after t
+  int lo = 0, hi = fCount.load(std::memory_order_acquire);
+  while (lo < hi) {
+    int mid = (lo + hi)/2;
+    if (fEnds[mid].load(std::memory_order_relaxed) <= t)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  return lo;
+}
+
+int ChunkSchedule::Append(int64_t end) {
+  // fMutex held, so there's only ever one of us
+  int n = fCount.load(std::memory_order_relaxed);
+  if (n >= kMaxChunks) return -1;
+  if (n > 0 && end <= fEnds[n-1].load(std::memory_order_relaxed)) return -1;
+  fEnds[n].store(end, std::memory_order_relaxed);
+  fCount.store(n+1, std::memory_order_release);
+  return 0;
+}
+
+void ChunkSchedule::Extend(int64_t watermark, int64_t latest, long bytes) {
+  if (!fLeader) return;
+  const std::lock_guard<std::mutex> lg(fMutex);
+  int n = fCount.load(std::memory_order_relaxed);
+  // everyone's past these chunks, so that's how fast they filled
+  int done = fMeasured;
+  while (done < n && fEnds[done].load(std::memory_order_relaxed) <= watermark) done++;
+  if (done > fMeasured) {
+    int64_t end = fEnds[done-1].load(std::memory_order_relaxed);
+    if (end > fMark) fRate = double(bytes - fMarkBytes)/(end - fMark);
+    fMark = end;
+    fMarkBytes = bytes;
+    fMeasured = done;
+  }
+  std::string lines;
+  for (int i = 0; i < kMaxAppend; i++, n++) {
+    if (n > 0 && n - Complete(latest) >= kChunksAhead &&
+        fEnds[n-1].load(std::memory_order_relaxed) >= latest + kTimeAhead)
+      break;
+    int64_t length = fRate > 0 ?
+      std::clamp<int64_t>(std::min(fTarget/fRate, 1e18), fMinLength, fMaxLength) : fLength;
+    int64_t end = (n > 0 ? fEnds[n-1].load(std::memory_order_relaxed) : 0) + length;
+    if (Append(end)) {
+      fLog->Entry(MongoLog::Error, "Chunk schedule is full at %i chunks", n);
+      break;
+    }
+    lines += std::to_string(end) + '\n';
+  }
+  if (lines.size() > 0 && write(fFD, lines.data(), lines.size()) != (ssize_t)lines.size())
+    fLog->Entry(MongoLog::Warning, "Can't write to %s: %s", fFileName.c_str(), std::strerror(errno));
+}
+
+void ChunkSchedule::Refresh() {
+  if (!fAdaptive || fLeader) return;
+  std::unique_lock<std::mutex> lk(fMutex, std::try_to_lock);
+  if (!lk.owns_lock()) return; // another thread's on it
+  int64_t now = std::chrono::duration_cast<std::chrono::nanoseconds>(
+      std::chrono::steady_clock::now().time_since_epoch()).count();
+  if (now - fLastRefresh < 100000000l) return;
+  fLastRefresh = now;
+  if (fFD < 0 && (fFD = open(fFileName.c_str(), O_RDONLY | O_CLOEXEC)) < 0)
+    return; // the leader hasn't started yet
+  char buf[65536];
+  ssize_t n;
+  while ((n = pread(fFD, buf, sizeof(buf), fReadPos)) > 0) {
+    fReadPos += n;
+    fPartial.append(buf, n);
+  }
+  std::size_t start = 0;
+  for (auto nl = fPartial.find('\n'); nl != std::string::npos; nl = fPartial.find('\n', start)) {
+    try {
+      Append(std::stol(fPartial.substr(start, nl - start)));
+    } catch (const std::exception&) {
+      fLog->Entry(MongoLog::Warning, "Bad line in %s", fFileName.c_str());
+    }
+    start = nl + 1;
+  }
+  fPartial.erase(0, start);
+}
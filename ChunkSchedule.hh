@@ -0,0 +1,66 @@
+#ifndef _CHUNKSCHEDULE_HH_
+#define _CHUNKSCHEDULE_HH_
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+
+class Options;
+class MongoLog;
+
+class ChunkSchedule{
+  /*
+    Where chunks end. Fixed length by default, so chunk c ends at
+    (c+1)*length. With strax_chunk_mode "adaptive" the ends come from a list
+    that one host (strax_chunk_leader) extends while the run goes, making each
+    new chunk as long as it takes to collect strax_chunk_target_size at the
+    rate the last complete chunks came in. The leader writes the list to
+    chunk_boundaries in the run directory and everyone else reads it from
+    there, so all hosts and threads cut in the same places.
+    The list only grows and only under fMutex, the formatters look up chunks
+    without locking.
+  */
+public:
+  // fixed length, ns (including the overlap)
+  ChunkSchedule(int64_t length);
+  // adaptive, throws if the boundary file can't be written (leader)
+  ChunkSchedule(std::shared_ptr<Options>&, std::shared_ptr<MongoLog>&, const std::string& run_dir,
+      bool leader);
+  ~ChunkSchedule();
+
+  bool Adaptive() {return fAdaptive;}
+  int ChunkOf(int64_t t); // -1 if the schedule doesn't reach that far (yet)
+  int64_t End(int chunk);
+  int Complete(int64_t t); // how many chunks end at or before t
+  int Known() {return fAdaptive ? fCount.load(std::memory_order_acquire) : INT32_MAX;}
+
+  // Leader, from the status thread: keep the schedule ahead of the newest data
+  void Extend(int64_t watermark, int64_t latest, long bytes);
+  // Followers: pick up what the leader published, at most every 100 ms
+  void Refresh();
+
+private:
+  int Append(int64_t end);
+
+  bool fAdaptive, fLeader;
+  int64_t fLength; // fixed, or the first chunks until we know the rate
+  int64_t fMinLength, fMaxLength, fOverlap, fTarget;
+  std::unique_ptr<std::atomic<int64_t>[]> fEnds;
+  std::atomic_int fCount;
+  std::mutex fMutex;
+  std::shared_ptr<MongoLog> fLog;
+  std::string fFileName;
+  int fFD;
+  long fReadPos; // follower, bytes of the file already parsed
+  std::string fPartial; // follower, an unfinished line
+  int64_t fLastRefresh; // steady ns
+  // leader: where we last measured the rate
+  int fMeasured;
+  int64_t fMark;
+  long fMarkBytes;
+  double fRate; // bytes per ns of data, 0 until measured
+};
+
+#endif // _CHUNKSCHEDULE_HH_ defined
@@ -6,14 +6,29 @@
 #include "DAXHelpers.hh"
 #include "Options.hh"
 #include "StraxFormatter.hh"
+#include "ChunkSchedule.hh"
+#include "Manifest.hh"
+#include "FileWriter.hh"
 #include "MongoLog.hh"
+#include "Profiler.hh"
+#include "SharedMetrics.hh"
+#include "MetricsServer.hh"
+#include "Histogram.hh"
 #include <algorithm>
 #include <bitset>
 #include <chrono>
 #include <cmath>
 #include <numeric>
+#include <fstream>
+#include <iomanip>
+#include <pthread.h>
 
 #include <bsoncxx/builder/stream/document.hpp>
+#include <bsoncxx/json.hpp>
+
+#ifndef REDAX_VERSION
+#define REDAX_VERSION "unknown"
+#endif
 
 // Status:
 // 0-idle
@@ -30,6 +45,14 @@ DAQController::DAQController(std::shared_ptr<MongoLog>& log, std::string hostnam
   fNProcessingThreads=8;
   fDataRate=0.;
   fHostname = hostname;
+  fHistoryHead = fHistorySize = 0;
+  fStatusBytes = 0;
+  fPeakRate = 0;
+  fProfiler = std::make_unique<Profiler>(fLog);
+  fProfileMode = kProfileOff;
+  fProfileTriggers = 0;
+  fRunNumber = -1;
+  fMetricsFailed = false;
 }
 
 DAQController::~DAQController(){
@@ -38,10 +61,40 @@ DAQController::~DAQController(){
 }
 
 int DAQController::Arm(std::shared_ptr<Options>& options){
+  auto phase_start = std::chrono::steady_clock::now();
+  {
+    const std::lock_guard<NamedMutex> lg(fMutex);
+    fArmTimings.clear();
+  }
+  auto phase = [&](const std::string& name) {
+    auto now = std::chrono::steady_clock::now();
+    const std::lock_guard<NamedMutex> lg(fMutex); // the status thread reads them
+    fArmTimings.emplace_back(name,
+        std::chrono::duration<double, std::milli>(now - phase_start).count());
+    phase_start = now;
+  };
   fOptions = options;
   fNProcessingThreads = fOptions->GetNestedInt("processing_threads."+fHostname, 8);
+  fLog->SetRateLimit(fOptions->GetInt("log_rate_limit_count", 10),
+      fOptions->GetInt("log_rate_limit_period", 10));
   fLog->Entry(MongoLog::Local, "Beginning electronics initialization with %i threads",
 	      fNProcessingThreads);
+  long budget = fOptions->GetInt("memory_budget", 0)*1000000l;
+  double input_fraction = fOptions->GetDouble("memory_budget_input_fraction", 0.5);
+  fInputHighWater = budget*input_fraction;
+  fOutputHighWater = budget - fInputHighWater;
+  fLowWater = fOptions->GetDouble("memory_budget_low_water", 0.8);
+  {
+    const std::lock_guard<std::mutex> lg(fProfilerMutex);
+    std::string mode = fOptions->GetString("profiler", "off");
+    fProfileMode = mode == "run" ? kProfileRun : (mode == "trigger" ? kProfileTrigger : kProfileOff);
+    fProfileHz = fOptions->GetInt("profiler_hz", 99);
+    fProfileThreshold = fOptions->GetInt("profiler_trigger_buffer", 1000)*1000000l;
+    fProfileWindow = fOptions->GetInt("profiler_window", 10);
+    fProfileMaxTriggers = fOptions->GetInt("profiler_max_triggers", 3);
+    fProfileTriggers = 0;
+    fRunNumber = fOptions->GetInt("number", -1);
+  }
 
   // Initialize digitizers
   fStatus = DAXHelpers::Arming;
@@ -68,13 +121,15 @@ int DAQController::Arm(std::shared_ptr<Options>& options){
       return -1;
     }
   }
-  fLog->Entry(MongoLog::Local, "This host has %i boards", BIDs.size());
+  phase("digitizers");
+  fLog->Entry(MongoLog::Local, "This host has %i boards", (int)BIDs.size());
   fLog->Entry(MongoLog::Local, "Sleeping for two seconds");
   // For the sake of sanity and sleeping through the night,
   // do not remove this statement.
   sleep(2); // <-- this one. Leave it here.
   // Seriously. This sleep statement is absolutely vital.
   fLog->Entry(MongoLog::Local, "That felt great, thanks.");
+  phase("sleep");
   std::map<int, std::vector<uint16_t>> dac_values;
   std::vector<std::thread> init_threads;
   init_threads.reserve(fDigitizers.size());
@@ -97,7 +152,10 @@ int DAQController::Arm(std::shared_ptr<Options>& options){
   } else
     fLog->Entry(MongoLog::Debug, "Digitizer programming successful");
   if (fOptions->GetString("baseline_dac_mode") == "fit") fOptions->UpdateDAC(dac_values);
+  phase("programming");
 
+  fArmTime = SteadyNs();
+  fMaxClockLead = long(fOptions->GetDouble("watermark_max_clock_lead", 5)*1e9);
   for(auto& link : fDigitizers ) {
     for(auto& digi : link.second){
       if(fOptions->GetInt("run_start", 0) == 1)
@@ -112,6 +170,7 @@ int DAQController::Arm(std::shared_ptr<Options>& options){
     fStatus = DAXHelpers::Idle;
     return -1;
   }
+  phase("threads");
   sleep(1);
   fStatus = DAXHelpers::Armed;
 
@@ -143,6 +202,10 @@ int DAQController::Start(){
     }
   }
   fStatus = DAXHelpers::Running;
+  fRunStart = std::chrono::system_clock::now();
+  NamedMutex::ResetStats();
+  const std::lock_guard<std::mutex> lg(fProfilerMutex);
+  if (fProfileMode == kProfileRun) StartProfiler("");
   return 0;
 }
 
@@ -172,6 +235,19 @@ int DAQController::Stop(){
   }
   fLog->Entry(MongoLog::Debug, "Stopped digitizers, closing threads");
   CloseThreads();
+  {
+    const std::lock_guard<std::mutex> lg(fProfilerMutex);
+    StopProfiler();
+    fProfileMode = kProfileOff;
+  }
+  if (fOptions && fRunStart.time_since_epoch().count() != 0) {
+    try{
+      SaveRunReport();
+    }catch(const std::exception& e){
+      fLog->Entry(MongoLog::Warning, "Failed to save run report: %s", e.what());
+    }
+  }
+  fRunStart = {};
   fLog->Entry(MongoLog::Local, "Closing Digitizers");
   for(auto& link : fDigitizers ){
     for(auto& digi : link.second){
@@ -201,10 +277,45 @@ void DAQController::ReadData(int link){
   std::list<std::unique_ptr<data_packet>> local_buffer;
   std::unique_ptr<data_packet> dp;
   int words = 0;
-  int local_size(0);
+  long local_size(0);
   fRunning[link] = true;
   std::chrono::microseconds sleep_time(fOptions->GetInt("us_between_reads", 10));
+  link_counters_t& counters = fLinkCounters[link];
+  std::chrono::microseconds throttle_sleep(fOptions->GetInt("backpressure_sleep_us", 1000));
+  bool throttled = false;
+  auto throttle_start = std::chrono::steady_clock::now();
+  std::map<int, int64_t> board_time; // ns, newest header time per board
+  int64_t latest = 0;
+  std::string name = "redax_ro" + std::to_string(link);
+  pthread_setname_np(pthread_self(), name.substr(0, 15).c_str());
+  PerfCounters perf;
+  std::string perf_error;
+  if (fOptions->GetInt("perf_counters", 0) && perf.Open(perf_error))
+    fLog->Entry(MongoLog::Message, "Hardware counters not available, continuing without: %s",
+        perf_error.c_str());
   while(fReadLoop){
+    // If the formatters are over their memory budget, stop reading and let
+    // the boards' buffers (and BUSY) take the pressure until they catch up
+    if (fInputHighWater + fOutputHighWater > 0 && (throttled || readcycler%16 == 0) &&
+        OverBudget(throttled) != throttled) {
+      throttled = !throttled;
+      counters.throttled = throttled;
+      auto now = std::chrono::steady_clock::now();
+      if (throttled) {
+        counters.throttle_events++;
+        throttle_start = now;
+        fLog->Entry(MongoLog::Message, "Link %i: formatters over their memory budget, pausing readout",
+            link);
+      } else {
+        long ns = std::chrono::duration_cast<std::chrono::nanoseconds>(now - throttle_start).count();
+        counters.throttle_ns += ns;
+        fLog->Entry(MongoLog::Local, "Link %i: resuming readout after %.1f ms", link, ns/1e6);
+      }
+    }
+    if (throttled) {
+      std::this_thread::sleep_for(throttle_sleep);
+      continue;
+    }
     for(auto& digi : fDigitizers[link]) {
 
       // Every 1k reads check board status
@@ -227,11 +338,27 @@ void DAQController::ReadData(int link){
                                          digi->bid());
         }
       }
+      // a board with nothing to give is caught up with whatever was read before we asked
+      latest = fLatestTime.load(std::memory_order_acquire);
       if((words = digi->Read(dp))<0){
         dp.reset();
         fStatus = DAXHelpers::Error;
         break;
-      } else if(words>0){
+      } else if (words == 0) {
+        board_time[digi->bid()] = std::max(board_time[digi->bid()], latest);
+      } else {
+        if (dp->clock_counter >= 0) {
+          int64_t t = ((dp->clock_counter<<31) + dp->header_time)*digi->GetClockWidth();
+          if (t > dp->read_time - fArmTime + fMaxClockLead) {
+            // the board's clock can't be ahead of ours, one bad header
+            // shouldn't drag the watermark (and every chunk) along with it
+            fLog->LimitedEntry(MongoLog::Warning, "Board %i header time %.3f s is %.3f s ahead of the run, ignoring it",
+                digi->bid(), t/1e9, (t - dp->read_time + fArmTime)/1e9);
+          } else {
+            board_time[digi->bid()] = std::max(board_time[digi->bid()], t);
+            for (int64_t l = fLatestTime; l < t && !fLatestTime.compare_exchange_weak(l, t);) {}
+          }
+        }
         dp->digi = digi;
         local_buffer.emplace_back(std::move(dp));
         local_size += words*sizeof(char32_t);
@@ -239,38 +366,129 @@ void DAQController::ReadData(int link){
     } // for digi in digitizers
     if (local_buffer.size() > 0) {
       fDataRate += local_size;
+      counters.bytes.fetch_add(local_size, std::memory_order_relaxed);
       int selector = (fCounter++)%fNProcessingThreads;
       fFormatters[selector]->ReceiveDatapackets(local_buffer, local_size);
       local_size = 0;
     }
+    // only once the data is queued, see StraxFormatter::ReceiveDatapackets
+    if (board_time.size() == fDigitizers[link].size()) {
+      UpdateWatermark(counters, std::min_element(board_time.begin(), board_time.end(),
+            [](auto& a, auto& b) {return a.second < b.second;})->second);
+    }
     readcycler++;
     std::this_thread::sleep_for(sleep_time);
   } // while run
+  if (throttled) {
+    counters.throttle_ns += std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now() - throttle_start).count();
+    counters.throttled = false;
+  }
+  fReadoutPerf[link] = perf.Read();
   fRunning[link] = false;
   fLog->Entry(MongoLog::Local, "RO thread %i returning", link);
 }
 
+void DAQController::UpdateWatermark(link_counters_t& link, int64_t t) {
+  // readout threads. Watermarks only go up, so any minimum we work out from
+  // what we see is at most the true one and it's safe to keep the largest
+  link.watermark = t;
+  int64_t wm = std::min_element(fLinkCounters.begin(), fLinkCounters.end(),
+      [](auto& a, auto& b) {return a.second.watermark < b.second.watermark;})->second.watermark;
+  for (int64_t w = fWatermark; w < wm && !fWatermark.compare_exchange_weak(w, wm);) {}
+}
+
+bool DAQController::OverBudget(bool throttled) {
+  // readout threads. The formatters outlive them so no need for the lock
+  long input = 0, output = 0, most = -1;
+  StraxFormatter* fullest = nullptr;
+  for (auto& sf : fFormatters) {
+    auto x = sf->GetBufferSize();
+    input += x.first;
+    output += x.second;
+    if (x.second > most) {
+      most = x.second;
+      fullest = sf.get();
+    }
+  }
+  double scale = throttled ? fLowWater : 1.;
+  bool output_over = fOutputHighWater > 0 && output > fOutputHighWater*scale;
+  // Output only goes down when chunks are sealed, which needs newer data,
+  // which we aren't reading. Make the fullest formatter seal one
+  if (output_over && fullest != nullptr) fullest->Drain();
+  return (fInputHighWater > 0 && input > fInputHighWater*scale) || output_over;
+}
+
 int DAQController::OpenThreads(){
-  const std::lock_guard<std::mutex> lg(fMutex);
+  const std::lock_guard<NamedMutex> lg(fMutex);
   fProcessingThreads.reserve(fNProcessingThreads);
   for(int i=0; i<fNProcessingThreads; i++){
     try {
       fFormatters.emplace_back(std::make_unique<StraxFormatter>(fOptions, fLog));
-      fProcessingThreads.emplace_back(&StraxFormatter::Process, fFormatters.back().get());
+      fFormatters.back()->SetWatermark(&fWatermark);
     } catch(const std::exception& e) {
       fLog->Entry(MongoLog::Warning, "Error opening processing threads: %s",
           e.what());
       return -1;
     }
   }
+  fSchedule.reset();
+  if (fOptions->GetString("strax_chunk_mode", "fixed") == "adaptive" && fFormatters.size() > 0) {
+    std::string leader = fOptions->GetString("strax_chunk_leader", "");
+    try {
+      if (leader == "") throw std::runtime_error("no strax_chunk_leader");
+      fSchedule = std::make_shared<ChunkSchedule>(fOptions, fLog,
+          fFormatters.front()->GetOutputPath(), leader == fHostname);
+      for (auto& sf : fFormatters) sf->SetSchedule(fSchedule);
+      fLog->Entry(MongoLog::Local, "Adaptive chunks, %s decides where they end",
+          leader == fHostname ? "we" : leader.c_str());
+    } catch(const std::exception& e) {
+      // not fixed-length instead, the other hosts would still cut adaptively
+      fLog->Entry(MongoLog::Error, "Can't do adaptive chunks: %s", e.what());
+      fSchedule.reset();
+      fFormatters.clear(); // no threads yet
+      return -1;
+    }
+  }
+  fManifest.reset();
+  if (fOptions->GetInt("strax_manifest", 1) && fFormatters.size() > 0) {
+    try {
+      fManifest = std::make_shared<Manifest>(fFormatters.front()->GetOutputPath(), fHostname,
+          fOptions->GetDouble("strax_manifest_fsync", 1), fLog);
+      for (auto& sf : fFormatters) sf->SetManifest(fManifest);
+    } catch(const std::exception& e) {
+      fLog->Entry(MongoLog::Warning, "No manifest for this run: %s", e.what());
+    }
+  }
+  if (!fManifest && fOptions->GetInt("strax_chunk_metadata", 1) && fFormatters.size() > 0)
+    fLog->Entry(MongoLog::Message, "No manifest, so no chunk metadata either");
+  // one for the whole host so each directory is only made once
+  fFileWriter = std::make_shared<FileWriter>(fLog);
+  // a manifest synced line by line shouldn't get ahead of the files it lists
+  fFileWriter->SetSync(fManifest && fOptions->GetDouble("strax_manifest_fsync", 1) == 0);
+  for (auto& sf : fFormatters) sf->SetFileWriter(fFileWriter);
+  for (auto& sf : fFormatters)
+    fProcessingThreads.emplace_back(&StraxFormatter::Process, sf.get());
   fReadoutThreads.reserve(fDigitizers.size());
+  fReadoutPerf.clear();
+  fLinkCounters.clear();
+  fWatermark = fLatestTime = 0;
+  fMetricsBoards.clear();
+  for (auto& p : fDigitizers) { // before any thread runs
+    fReadoutPerf[p.first] = {0, 0, 0, 0};
+    auto& c = fLinkCounters[p.first];
+    c.bytes = c.throttle_events = c.throttle_ns = 0;
+    c.throttled = false;
+    c.watermark = 0;
+    for (auto& digi : p.second) fMetricsBoards.emplace_back(p.first, digi);
+  }
   for (auto& p : fDigitizers)
     fReadoutThreads.emplace_back(&DAQController::ReadData, this, p.first);
   return 0;
 }
 
 void DAQController::CloseThreads(){
-  const std::lock_guard<std::mutex> lg(fMutex);
+  const std::lock_guard<NamedMutex> lg(fMutex);
   fLog->Entry(MongoLog::Local, "Ending RO threads");
   for (auto& t : fReadoutThreads) if (t.joinable()) t.join();
   fLog->Entry(MongoLog::Local, "Joining processing threads");
@@ -281,10 +499,59 @@ void DAQController::CloseThreads(){
     sf->Close(board_fails);
   }
   for (auto& t : fProcessingThreads) if (t.joinable()) t.join();
+  if (fManifest) fManifest->End(fProcessingThreads.size());
+  fManifest.reset();
   fProcessingThreads.clear();
+  fMetricsBoards.clear();
+  fRunHistograms.clear();
+  fRunStats.clear();
+  fRunLatencies.clear();
+  fRunTrace.clear();
+  std::map<std::string, std::vector<long>> latencies;
+  std::map<std::string, long> max_latency;
+  for (auto& sf : fFormatters) {
+    for (auto& [name, hist] : sf->GetHistograms()) hist->AddTo(fRunHistograms[name]);
+    for (auto& [name, hist] : sf->GetLatencies()) {
+      hist->AddTo(latencies[name]);
+      max_latency[name] = std::max(max_latency[name], hist->Max());
+    }
+    fRunStats.push_back(sf->GetRunStats());
+    fRunTrace.push_back(std::move(sf->GetTrace()));
+    fRunDirectory = sf->GetOutputPath();
+  }
+  if (fFormatters.size() > 0) {
+    for (auto& [name, hist] : fFormatters.front()->GetHistograms()) {
+      auto& counts = fRunHistograms[name];
+      std::stringstream msg;
+      msg << "Run summary " << name << ":";
+      for (unsigned i = 0; i < counts.size(); i++)
+        if (counts[i] != 0) msg << ' ' << hist->Label(i) << ':' << counts[i];
+      fLog->Entry(MongoLog::Local, msg.str());
+    }
+    for (auto& [name, hist] : fFormatters.front()->GetLatencies()) {
+      auto& counts = latencies[name];
+      auto& lat = fRunLatencies[name];
+      lat["count"] = std::accumulate(counts.begin(), counts.end(), 0L);
+      lat["p50"] = hist->Percentile(counts, 0.5);
+      lat["p90"] = hist->Percentile(counts, 0.9);
+      lat["p99"] = hist->Percentile(counts, 0.99);
+      lat["max"] = max_latency[name];
+      fLog->Entry(MongoLog::Local, "Latency %s: p50 %li us, p90 %li us, p99 %li us, max %li us",
+          name.c_str(), lat["p50"], lat["p90"], lat["p99"], lat["max"]);
+    }
+  }
   fLog->Entry(MongoLog::Local, "Destroying formatters");
   for (auto& sf : fFormatters) sf.reset();
   fFormatters.clear();
+  if (fFileWriter) {
+    fLog->Entry(MongoLog::Local, "Wrote %.1f MB of files, another %.1f MB are links to them",
+        fFileWriter->BytesWritten()/1e6, fFileWriter->BytesLinked()/1e6);
+    fFileWriter.reset();
+  }
+  if (fSchedule) {
+    fLog->Entry(MongoLog::Local, "%i chunks in the adaptive schedule", fSchedule->Known());
+    fSchedule.reset();
+  }
 
   if (std::accumulate(board_fails.begin(), board_fails.end(), 0,
 	[=](int tot, auto& iter) {return std::move(tot) + iter.second;})) {
@@ -299,36 +566,503 @@ void DAQController::StatusUpdate(mongocxx::collection* collection) {
   using namespace bsoncxx::builder::stream;
   auto insert_doc = document{};
   std::map<int, int> retmap;
+  std::map<std::string, std::vector<long>> histograms;
   std::pair<long, long> buf{0,0};
-  int rate = fDataRate;
-  fDataRate = 0;
+  int throttled = 0;
+  long throttle_events = 0, spill = 0;
+  long rate = fStatusBytes + fDataRate.exchange(0);
+  fStatusBytes = 0;
+  double peak = fPeakRate;
+  fPeakRate = 0;
   {
-    const std::lock_guard<std::mutex> lg(fMutex);
+    const std::lock_guard<NamedMutex> lg(fMutex);
     for (auto& p : fFormatters) {
       p->GetDataPerChan(retmap);
+      for (auto& [name, hist] : p->GetHistograms()) hist->AddTo(histograms[name]);
       auto x = p->GetBufferSize();
       buf.first += x.first;
       buf.second += x.second;
+      spill += p->GetSpillSize();
+    }
+    for (auto& [link, c] : fLinkCounters) {
+      throttled += c.throttled;
+      throttle_events += c.throttle_events;
     }
   }
   auto doc = document{} <<
     "host" << fHostname <<
     "time" << bsoncxx::types::b_date(std::chrono::system_clock::now())<<
     "rate" << rate/1e6 <<
+    "rate_peak" << peak/1e6 <<
     "status" << fStatus <<
     "buffer_size" << (buf.first + buf.second)/1e6 <<
+    "spill_size" << spill/1e6 <<
+    "watermark_lag" << (fLatestTime - fWatermark)/1e9 <<
+    "throttled_links" << throttled <<
+    "throttle_events" << (int64_t)throttle_events <<
+    "log_dropped" << fLog->GetDropped() <<
+    "log_suppressed" << fLog->GetSuppressed() <<
     "mode" << (fOptions ? fOptions->GetString("name", "none") : "none") <<
     "number" << (fOptions ? fOptions->GetInt("number", -1) : -1) <<
     "channels" << open_document <<
       [&](key_context<> doc){
       for( auto const& pair : retmap)
         doc << std::to_string(pair.first) << short(pair.second>>10); // KB not MB
-      } << close_document << 
+      } << close_document <<
+    "histograms" << open_document <<
+      [&](key_context<> doc){
+      for (auto& [name, counts] : histograms)
+        doc << name << open_array << [&](array_context<> arr) {
+          for (auto c : counts) arr << (int64_t)c;
+        } << close_array;
+      } << close_document <<
     finalize;
   collection->insert_one(std::move(doc)); // opts is const&
   return;
 }
 
+void DAQController::SetRateHistory(int samples) {
+  fRateHistory.assign(std::max(samples, 1), rate_sample_t{});
+  fHistoryHead = fHistorySize = 0;
+}
+
+void DAQController::SampleCounters() {
+  rate_sample_t sample;
+  sample.time = std::chrono::system_clock::now();
+  sample.bytes = fDataRate.exchange(0);
+  sample.buffer = 0;
+  long input_buffer = 0;
+  {
+    const std::lock_guard<NamedMutex> lg(fMutex);
+    for (auto& p : fFormatters) {
+      auto x = p->GetBufferSize();
+      sample.buffer += x.first + x.second;
+      input_buffer += x.first;
+    }
+    if (fSchedule) {
+      long bytes = 0;
+      for (auto& [link, c] : fLinkCounters) bytes += c.bytes;
+      fSchedule->Extend(fWatermark, fLatestTime, bytes);
+    }
+  }
+  CheckProfiler(input_buffer);
+  PublishMetrics();
+  double dt = std::chrono::duration<double>(sample.time - fLastSample).count();
+  if (fLastSample.time_since_epoch().count() != 0 && dt > 0)
+    fPeakRate = std::max(fPeakRate, sample.bytes/dt);
+  fLastSample = sample.time;
+  fStatusBytes += sample.bytes;
+  if (fRateHistory.size() == 0) return;
+  // oldest samples get overwritten if we can't flush for a while
+  fRateHistory[(fHistoryHead + fHistorySize) % fRateHistory.size()] = sample;
+  if (fHistorySize < fRateHistory.size())
+    fHistorySize++;
+  else
+    fHistoryHead = (fHistoryHead + 1) % fRateHistory.size();
+}
+
+void DAQController::FlushRateHistory(mongocxx::collection* collection, bool timeseries) {
+  using namespace bsoncxx::builder::stream;
+  if (fHistorySize == 0) return;
+  auto sample = [&](std::size_t i) -> rate_sample_t& {
+    return fRateHistory[(fHistoryHead + i) % fRateHistory.size()];
+  };
+  if (timeseries) {
+    // one doc per sample, the server packs them into buckets for us
+    std::vector<bsoncxx::document::value> docs;
+    docs.reserve(fHistorySize);
+    for (std::size_t i = 0; i < fHistorySize; i++) {
+      docs.emplace_back(document{} <<
+          "time" << bsoncxx::types::b_date(sample(i).time) <<
+          "host" << fHostname <<
+          "bytes" << (int64_t)sample(i).bytes <<
+          "buffer" << (int64_t)sample(i).buffer <<
+          finalize);
+    }
+    collection->insert_many(docs);
+  } else {
+    // one doc for the whole batch, with offsets in ms from the first sample
+    auto t0 = sample(0).time;
+    auto doc = document{} <<
+      "host" << fHostname <<
+      "time" << bsoncxx::types::b_date(t0) <<
+      "dt" << open_array << [&](array_context<> arr) {
+        for (std::size_t i = 0; i < fHistorySize; i++)
+          arr << (int)std::chrono::duration_cast<std::chrono::milliseconds>(sample(i).time - t0).count();
+      } << close_array <<
+      "bytes" << open_array << [&](array_context<> arr) {
+        for (std::size_t i = 0; i < fHistorySize; i++) arr << (int64_t)sample(i).bytes;
+      } << close_array <<
+      "buffer" << open_array << [&](array_context<> arr) {
+        for (std::size_t i = 0; i < fHistorySize; i++) arr << (int64_t)sample(i).buffer;
+      } << close_array <<
+      finalize;
+    collection->insert_one(std::move(doc));
+  }
+  fHistoryHead = fHistorySize = 0;
+}
+
+void DAQController::SaveRunReport() {
+  using namespace bsoncxx::builder::stream;
+  auto end = std::chrono::system_clock::now();
+  double duration = std::chrono::duration<double>(end - fRunStart).count();
+  formatter_stats_t total{};
+  for (auto& s : fRunStats) {
+    total.data_packets_us += s.data_packets_us;
+    total.events_us += s.events_us;
+    total.fragments_us += s.fragments_us;
+    total.compression_us += s.compression_us;
+    total.bytes_in += s.bytes_in;
+    total.bytes_uncompressed += s.bytes_uncompressed;
+    total.bytes_compressed += s.bytes_compressed;
+    total.fragments += s.fragments;
+    total.max_input_buffer = std::max(total.max_input_buffer, s.max_input_buffer);
+    total.spill_events += s.spill_events;
+    total.bytes_spilled += s.bytes_spilled;
+    total.max_spill = std::max(total.max_spill, s.max_spill);
+    total.late_fragments += s.late_fragments;
+    total.late_files += s.late_files;
+    total.failed_writes += s.failed_writes;
+    total.write_bytes += s.write_bytes;
+    total.write_us += s.write_us;
+    total.perf_data_packets += s.perf_data_packets;
+    total.perf_compression += s.perf_compression;
+  }
+  perf_values_t readout_perf{0, 0, 0, 0};
+  for (auto& p : fReadoutPerf) readout_perf += p.second;
+  auto perf = [](key_context<> doc, const perf_values_t& p) {
+    doc << "cycles" << (int64_t)p.cycles <<
+      "instructions" << (int64_t)p.instructions <<
+      "cache_misses" << (int64_t)p.cache_misses <<
+      "branch_misses" << (int64_t)p.branch_misses <<
+      "ipc" << (p.cycles > 0 ? 1.*p.instructions/p.cycles : 0.);
+  };
+  auto stats = [&](key_context<> doc, const formatter_stats_t& s) {
+    doc << "cpu_us" << open_document <<
+        "data_packets" << s.data_packets_us <<
+        "events" << s.events_us <<
+        "fragments" << s.fragments_us <<
+        "compression" << s.compression_us <<
+      close_document <<
+      "bytes_in" << (int64_t)s.bytes_in <<
+      "bytes_uncompressed" << (int64_t)s.bytes_uncompressed <<
+      "bytes_compressed" << (int64_t)s.bytes_compressed <<
+      "compression_ratio" << (s.bytes_compressed > 0 ? 1.*s.bytes_uncompressed/s.bytes_compressed : 0.) <<
+      "fragments" << (int64_t)s.fragments <<
+      "max_input_buffer" << (int64_t)s.max_input_buffer <<
+      "spill_events" << s.spill_events <<
+      "bytes_spilled" << (int64_t)s.bytes_spilled <<
+      "max_spill" << (int64_t)s.max_spill <<
+      "late_fragments" << (int64_t)s.late_fragments <<
+      "late_files" << s.late_files <<
+      "failed_writes" << s.failed_writes <<
+      "write_bytes" << (int64_t)s.write_bytes <<
+      "write_us" << s.write_us <<
+      "write_mb_per_s" << (s.write_us > 0 ? s.write_bytes/s.write_us : 0.);
+    if (s.perf_data_packets.cycles + s.perf_compression.cycles > 0) {
+      doc << "perf" << open_document <<
+        "data_packets" << open_document << [&](key_context<> sub) {perf(sub, s.perf_data_packets);} << close_document <<
+        "compression" << open_document << [&](key_context<> sub) {perf(sub, s.perf_compression);} << close_document <<
+        close_document;
+    }
+  };
+  auto doc = document{} <<
+    "host" << fHostname <<
+    "run" << fOptions->GetInt("number", -1) <<
+    "mode" << fOptions->GetString("name", "none") <<
+    "version" << REDAX_VERSION <<
+    "start" << bsoncxx::types::b_date(fRunStart) <<
+    "end" << bsoncxx::types::b_date(end) <<
+    "duration_s" << duration <<
+    "fragments_per_s" << (duration > 0 ? total.fragments/duration : 0.) <<
+    "arm_ms" << open_document << [&](key_context<> doc) {
+      for (auto& [name, ms] : fArmTimings) doc << name << ms;
+    } << close_document <<
+    "total" << open_document << [&](key_context<> doc) {stats(doc, total);} << close_document <<
+    "threads" << open_array << [&](array_context<> arr) {
+      for (auto& s : fRunStats)
+        arr << open_document << "thread" << s.thread <<
+          [&](key_context<> doc) {stats(doc, s);} << close_document;
+    } << close_array <<
+    "readout_perf" << open_document << [&](key_context<> doc) {
+      if (readout_perf.cycles > 0) perf(doc, readout_perf);
+    } << close_document <<
+    "backpressure" << open_document << [&](key_context<> doc) {
+      for (auto& [link, c] : fLinkCounters)
+        doc << std::to_string(link) << open_document <<
+          "events" << (int64_t)c.throttle_events <<
+          "seconds" << c.throttle_ns/1e9 <<
+          close_document;
+    } << close_document <<
+    "boards" << open_array << [&](array_context<> arr) {
+      for (auto& [link, digis] : fDigitizers) {
+        for (auto& digi : digis) {
+          auto r = digi->GetReadoutStats();
+          arr << open_document <<
+            "board" << digi->bid() <<
+            "link" << link <<
+            "reads" << (int64_t)r.reads <<
+            "blts" << (int64_t)r.blts <<
+            "bytes" << (int64_t)r.bytes <<
+            "rollovers" << r.rollovers <<
+            close_document;
+        }
+      }
+    } << close_array <<
+    "histograms" << open_document << [&](key_context<> doc) {
+      for (auto& [name, counts] : fRunHistograms)
+        doc << name << open_array << [&](array_context<> arr) {
+          for (auto c : counts) arr << (int64_t)c;
+        } << close_array;
+    } << close_document <<
+    "latency_us" << open_document << [&](key_context<> doc) {
+      for (auto& [stage, lat] : fRunLatencies)
+        doc << stage << open_document << [&](key_context<> sub) {
+          for (auto& [k, v] : lat) sub << k << (int64_t)v;
+        } << close_document;
+    } << close_document <<
+    "locks" << open_document << [&](key_context<> doc) {
+      for (auto& [name, s] : NamedMutex::Stats())
+        doc << name << open_document <<
+          "acquisitions" << (int64_t)s.acquisitions <<
+          "contended" << (int64_t)s.contended <<
+          "wait_us" << s.wait_us <<
+          "max_hold_us" << s.max_hold_us <<
+          close_document;
+    } << close_document <<
+    finalize;
+
+  if (fRunDirectory != "") {
+    std::ofstream fout(fRunDirectory + "/" + fHostname + "_report.json");
+    fout << bsoncxx::to_json(doc.view()) << '\n';
+  }
+  if (fRunDirectory != "" && std::any_of(fRunTrace.begin(), fRunTrace.end(),
+        [](auto& t) {return t.size() > 0;}))
+    SaveTrace(fRunDirectory + "/" + fHostname + "_trace.json");
+  fOptions->SaveRunReport(doc);
+  long throttle_events = 0, throttle_ns = 0;
+  for (auto& [link, c] : fLinkCounters) {
+    throttle_events += c.throttle_events;
+    throttle_ns += c.throttle_ns;
+  }
+  if (total.late_fragments > 0)
+    fLog->Entry(MongoLog::Warning, "%li fragments came after their chunk was written, they're in %i _late files",
+        total.late_fragments, total.late_files);
+  if (total.failed_writes > 0)
+    fLog->Entry(MongoLog::Error, "%i chunk files couldn't be written", total.failed_writes);
+  if (throttle_events > 0)
+    fLog->Entry(MongoLog::Warning, "Readout paused %li times (%.1f s in total) for the memory budget",
+        throttle_events, throttle_ns/1e9);
+  fLog->Entry(MongoLog::Local, "Run report: %.1f MB in, compression ratio %.2f, %.0f fragments/s",
+      total.bytes_in/1e6, total.bytes_compressed > 0 ? 1.*total.bytes_uncompressed/total.bytes_compressed : 0.,
+      duration > 0 ? total.fragments/duration : 0.);
+}
+
+void DAQController::SaveTrace(const std::string& filename) {
+  // Chrome trace-event format, load it in chrome://tracing or Perfetto
+  std::ofstream fout(filename);
+  fout << "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n";
+  fout << "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":0,\"args\":{\"name\":\""
+    << fHostname << "\"}}";
+  fout << std::fixed << std::setprecision(3);
+  for (unsigned tid = 0; tid < fRunTrace.size(); tid++) {
+    fout << ",\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":0,\"tid\":" << tid
+      << ",\"args\":{\"name\":\"formatter " << tid << "\"}}";
+    for (auto& ev : fRunTrace[tid]) {
+      fout << ",\n{\"name\":\"" << ev.name << "\",\"cat\":\"" << ev.category
+        << "\",\"ph\":\"X\",\"pid\":0,\"tid\":" << tid
+        << ",\"ts\":" << ev.start/1e3 << ",\"dur\":" << ev.duration/1e3
+        << ",\"args\":{\"" << ev.category << "\":" << ev.id << "}}";
+    }
+  }
+  fout << "\n]}\n";
+  fRunTrace.clear();
+}
+
+void DAQController::CheckProfiler(long input_buffer) {
+  // status thread
+  const std::lock_guard<std::mutex> lg(fProfilerMutex);
+  if (fProfileMode != kProfileTrigger) return;
+  if (fProfiler->Running()) {
+    if (std::chrono::steady_clock::now() > fProfileUntil) StopProfiler();
+    return;
+  }
+  if (fStatus != DAXHelpers::Running || input_buffer < fProfileThreshold ||
+      fProfileTriggers >= fProfileMaxTriggers)
+    return;
+  fLog->Entry(MongoLog::Message, "Formatter input buffers at %.1f MB, profiling for %i s",
+      input_buffer/1e6, fProfileWindow);
+  if (StartProfiler("_trigger" + std::to_string(fProfileTriggers++)) == 0)
+    fProfileUntil = std::chrono::steady_clock::now() + std::chrono::seconds(fProfileWindow);
+}
+
+int DAQController::StartProfiler(std::string suffix) {
+  // call with fProfilerMutex held
+  if (fProfiler->Running()) return -1;
+  fProfileFile = (fLogDir == "" ? std::string(".") : fLogDir) + "/" +
+    std::to_string(fRunNumber) + "_" + fHostname + suffix + ".folded";
+  return fProfiler->Start(fProfileHz);
+}
+
+void DAQController::StopProfiler() {
+  // call with fProfilerMutex held
+  if (!fProfiler->Running()) return;
+  long samples = fProfiler->Stop(fProfileFile);
+  fLog->Entry(MongoLog::Local, "Wrote %li profile samples to %s", samples, fProfileFile.c_str());
+}
+
+int DAQController::ServeMetrics(const std::string& address) {
+  fMetricsServer = std::make_unique<MetricsServer>(fLog);
+  if (fMetricsServer->Listen(address)) {
+    fMetricsServer.reset();
+    return -1;
+  }
+  return 0;
+}
+
+void DAQController::PublishMetrics() {
+  // status thread
+  if (!fMetrics && !fMetricsFailed) {
+    fMetrics = std::make_unique<SharedMetrics>(fHostname, true);
+    if (!fMetrics->IsOpen()) {
+      fLog->Entry(MongoLog::Message, "No live metrics for redax-top: %s", fMetrics->Error().c_str());
+      fMetrics.reset();
+      fMetricsFailed = true;
+    }
+  }
+  if (!fMetrics && !fMetricsServer) return;
+  metrics_t m{};
+  m.time_ns = std::chrono::duration_cast<std::chrono::nanoseconds>(
+      std::chrono::system_clock::now().time_since_epoch()).count();
+  m.status = fStatus;
+  m.run = fStatus == DAXHelpers::Idle ? -1 : fRunNumber.load();
+  m.log_dropped = fLog->GetDropped();
+  m.log_suppressed = fLog->GetSuppressed();
+  std::vector<long> write_latency;
+  long write_latency_sum = 0; // us
+  long uncompressed = 0, compressed = 0;
+  std::vector<std::pair<std::string, double>> arm_timings;
+  {
+    const std::lock_guard<NamedMutex> lg(fMutex);
+    for (unsigned i = 0; i < fFormatters.size() && m.n_formatters < kMetricsMaxFormatters; i++) {
+      auto& f = m.formatters[m.n_formatters++];
+      std::tie(f.input_bytes, f.output_bytes) = fFormatters[i]->GetBufferSize();
+      f.spill_bytes = fFormatters[i]->GetSpillSize();
+      clockid_t cid;
+      struct timespec ts;
+      if (i < fProcessingThreads.size() &&
+          pthread_getcpuclockid(fProcessingThreads[i].native_handle(), &cid) == 0 &&
+          clock_gettime(cid, &ts) == 0)
+        f.cpu_ns = ts.tv_sec*1000000000l + ts.tv_nsec;
+    }
+    for (auto& [link, c] : fLinkCounters) {
+      if (m.n_links == kMetricsMaxLinks) break;
+      auto& l = m.links[m.n_links++];
+      l.link = link;
+      l.bytes = c.bytes.load(std::memory_order_relaxed);
+      l.throttled = c.throttled;
+      l.throttle_events = c.throttle_events;
+      l.throttle_ns = c.throttle_ns;
+      l.boards = std::count_if(fMetricsBoards.begin(), fMetricsBoards.end(),
+          [&](auto& p) {return p.first == link;});
+    }
+    for (auto& [link, digi] : fMetricsBoards) {
+      if (m.n_boards == kMetricsMaxBoards) break;
+      auto r = digi->GetReadoutStats();
+      m.boards[m.n_boards++] = {digi->bid(), link, r.reads, r.blts, r.bytes};
+    }
+    if (fMetricsServer) {
+      for (auto& sf : fFormatters) {
+        auto [u, c] = sf->GetCompressedBytes();
+        uncompressed += u;
+        compressed += c;
+        sf->GetLatencies()["write"]->AddTo(write_latency);
+        write_latency_sum += sf->GetLatencies()["write"]->Sum();
+      }
+      arm_timings = fArmTimings;
+    }
+  }
+  if (fMetrics) fMetrics->Publish(m);
+  if (fMetricsServer)
+    fMetricsServer->Update(RenderMetrics(m, write_latency, write_latency_sum, uncompressed, compressed, arm_timings));
+}
+
+std::string DAQController::RenderMetrics(const metrics_t& m, const std::vector<long>& write_latency,
+    long write_latency_sum, long uncompressed, long compressed, const std::vector<std::pair<std::string, double>>& arm_timings) {
+  // Prometheus text exposition format
+  std::stringstream ss;
+  auto help = [&](const char* name, const char* type, const char* text) {
+    ss << "# HELP " << name << ' ' << text << "\n# TYPE " << name << ' ' << type << '\n';
+  };
+  help("redax_status", "gauge", "0 idle, 1 arming, 2 armed, 3 running, 4 error");
+  ss << "redax_status " << m.status << '\n';
+  help("redax_run_number", "gauge", "Current run, -1 when idle");
+  ss << "redax_run_number " << m.run << '\n';
+  help("redax_link_read_bytes_total", "counter", "Bytes read from the digitizers per optical link");
+  for (int i = 0; i < m.n_links; i++)
+    ss << "redax_link_read_bytes_total{link=\"" << m.links[i].link << "\"} " << m.links[i].bytes << '\n';
+  help("redax_link_throttled", "gauge", "1 while readout is paused for the memory budget");
+  for (int i = 0; i < m.n_links; i++)
+    ss << "redax_link_throttled{link=\"" << m.links[i].link << "\"} " << m.links[i].throttled << '\n';
+  help("redax_link_throttle_events_total", "counter", "Times readout paused for the memory budget");
+  for (int i = 0; i < m.n_links; i++)
+    ss << "redax_link_throttle_events_total{link=\"" << m.links[i].link << "\"} " << m.links[i].throttle_events << '\n';
+  help("redax_link_throttle_seconds_total", "counter", "Time readout spent paused for the memory budget");
+  for (int i = 0; i < m.n_links; i++)
+    ss << "redax_link_throttle_seconds_total{link=\"" << m.links[i].link << "\"} " << m.links[i].throttle_ns/1e9 << '\n';
+  help("redax_board_read_bytes_total", "counter", "Bytes read per board");
+  for (int i = 0; i < m.n_boards; i++)
+    ss << "redax_board_read_bytes_total{board=\"" << m.boards[i].bid << "\",link=\"" <<
+      m.boards[i].link << "\"} " << m.boards[i].bytes << '\n';
+  help("redax_board_reads_total", "counter", "Reads that returned data per board");
+  for (int i = 0; i < m.n_boards; i++)
+    ss << "redax_board_reads_total{board=\"" << m.boards[i].bid << "\",link=\"" <<
+      m.boards[i].link << "\"} " << m.boards[i].reads << '\n';
+  help("redax_formatter_input_buffer_bytes", "gauge", "Data waiting to be processed per thread");
+  for (int i = 0; i < m.n_formatters; i++)
+    ss << "redax_formatter_input_buffer_bytes{thread=\"" << i << "\"} " << m.formatters[i].input_bytes << '\n';
+  help("redax_formatter_spill_bytes", "gauge", "Input spilled to disk, not read back yet, per thread");
+  for (int i = 0; i < m.n_formatters; i++)
+    ss << "redax_formatter_spill_bytes{thread=\"" << i << "\"} " << m.formatters[i].spill_bytes << '\n';
+  help("redax_formatter_output_buffer_bytes", "gauge", "Processed data waiting to be written per thread");
+  for (int i = 0; i < m.n_formatters; i++)
+    ss << "redax_formatter_output_buffer_bytes{thread=\"" << i << "\"} " << m.formatters[i].output_bytes << '\n';
+  help("redax_formatter_cpu_seconds_total", "counter", "CPU time per processing thread");
+  for (int i = 0; i < m.n_formatters; i++)
+    ss << "redax_formatter_cpu_seconds_total{thread=\"" << i << "\"} " << m.formatters[i].cpu_ns/1e9 << '\n';
+  help("redax_uncompressed_bytes_total", "counter", "Bytes into the compressor");
+  ss << "redax_uncompressed_bytes_total " << uncompressed << '\n';
+  help("redax_compressed_bytes_total", "counter", "Bytes written to disk");
+  ss << "redax_compressed_bytes_total " << compressed << '\n';
+  help("redax_compression_ratio", "gauge", "Uncompressed over compressed bytes this run");
+  ss << "redax_compression_ratio " << (compressed > 0 ? 1.*uncompressed/compressed : 0.) << '\n';
+
+  // Collapse the ~10% buckets into powers of 2, edges are in seconds. Every
+  // edge is always there (AddTo trims empty buckets), the last bucket is
+  // the overflow so it only goes into +Inf
+  help("redax_chunk_write_latency_seconds", "histogram", "From sealing a chunk to it being on disk");
+  static const Histogram binning(Histogram::Log2Fine, 304);
+  long count = 0;
+  for (int i = 0; i < binning.NBins()-1; i++) {
+    if (i < (int)write_latency.size()) count += write_latency[i];
+    if (i >= 7 && (i+1)%8 == 0)
+      ss << "redax_chunk_write_latency_seconds_bucket{le=\"" << binning.Lower(i+1)/1e6 << "\"} " << count << '\n';
+  }
+  for (unsigned i = binning.NBins()-1; i < write_latency.size(); i++) count += write_latency[i];
+  ss << "redax_chunk_write_latency_seconds_bucket{le=\"+Inf\"} " << count << '\n';
+  ss << "redax_chunk_write_latency_seconds_sum " << write_latency_sum/1e6 << '\n';
+  ss << "redax_chunk_write_latency_seconds_count " << count << '\n';
+
+  help("redax_log_dropped_total", "counter", "Log messages dropped because the queue was full");
+  ss << "redax_log_dropped_total " << m.log_dropped << '\n';
+  help("redax_log_suppressed_total", "counter", "Log messages suppressed by the rate limit");
+  ss << "redax_log_suppressed_total " << m.log_suppressed << '\n';
+  help("redax_arm_phase_seconds", "gauge", "Time spent in each phase of the last arm");
+  for (auto& [name, ms] : arm_timings)
+    ss << "redax_arm_phase_seconds{phase=\"" << name << "\"} " << ms/1e3 << '\n';
+  return ss.str();
+}
+
 void DAQController::InitLink(std::vector<std::shared_ptr<V1724>>& digis,
     std::map<int, std::vector<uint16_t>>& dac_values, int& ret) {
   std::string BL_MODE = fOptions->GetString("baseline_dac_mode", "fixed");
@@ -360,7 +1094,7 @@ void DAQController::InitLink(std::vector<std::shared_ptr<V1724>>& digis,
     }
 
     if(success==-2){
-      fLog->Entry(MongoLog::Warning, "Board %i Baselines failed with digi error");
+      fLog->Entry(MongoLog::Warning, "Board %i Baselines failed with digi error", bid);
       ret = -2;
       return;
     } else if(success!=0){
@@ -571,7 +1305,7 @@ int DAQController::FitBaselines(std::vector<std::shared_ptr<V1724>> &digis,
                 fLog->Entry(MongoLog::Local,
                     "Bd %i ch %i: %i out of %i counts around max %i",
                     bid, ch, counts_around_max, counts_total,
-                    std::distance(hist.begin(), max_it)<<rebin_factor);
+                    (int)std::distance(hist.begin(), max_it)<<rebin_factor);
                 redo_iter = true;
               }
               if (counts_total < 1.5*words) {//25% zeros
@@ -667,7 +1401,7 @@ int DAQController::FitBaselines(std::vector<std::shared_ptr<V1724>> &digis,
     for (unsigned ch = 0; ch < d->GetNumChannels(); ch++) {
       bid = d->bid();
       fLog->Entry(MongoLog::Local, "Bd %i ch %i exp %x act %x", bid, ch,
-        (target_baseline-cal_values[bid]["yint"][ch])/cal_values[bid]["slope"][ch],
+        (int)((target_baseline-cal_values[bid]["yint"][ch])/cal_values[bid]["slope"][ch]),
         dac_values[bid][ch]);
     }
   }
@@ -9,12 +9,38 @@
 #include <cstdint>
 #include <mutex>
 #include <list>
+#include <chrono>
 #include <mongocxx/collection.hpp>
+#include "PerfCounters.hh"
+#include "NamedMutex.hh"
 
 class StraxFormatter;
+class ChunkSchedule;
+class Manifest;
+class FileWriter;
+struct formatter_stats_t;
+struct trace_event_t;
 class MongoLog;
 class Options;
 class V1724;
+class Profiler;
+class SharedMetrics;
+class MetricsServer;
+struct metrics_t;
+
+struct link_counters_t { // per optical link, since the threads started
+  std::atomic_long bytes;
+  std::atomic_long throttle_events; // times readout paused for the memory budget
+  std::atomic_long throttle_ns;
+  std::atomic_bool throttled;
+  std::atomic<int64_t> watermark; // ns, everything before this has been read from every board
+};
+
+struct rate_sample_t {
+  std::chrono::system_clock::time_point time;
+  long bytes; // read out since the previous sample
+  long buffer; // bytes waiting in the formatters
+};
 
 class DAQController{
   /*
@@ -30,6 +56,11 @@ public:
   virtual int Start();
   virtual int Stop();
   virtual void StatusUpdate(mongocxx::collection*);
+  virtual void SampleCounters();
+  virtual void FlushRateHistory(mongocxx::collection*, bool);
+  void SetRateHistory(int);
+  void SetLogDir(std::string dir) {fLogDir = dir;}
+  int ServeMetrics(const std::string& address);
   int status() {return fStatus;}
 
 protected:
@@ -44,12 +75,22 @@ private:
   void CloseThreads();
   void InitLink(std::vector<std::shared_ptr<V1724>>&, std::map<int, std::vector<uint16_t>>&, int&);
   int FitBaselines(std::vector<std::shared_ptr<V1724>>&, std::map<int, std::vector<uint16_t>>&, int);
+  void SaveRunReport();
+  void SaveTrace(const std::string&);
+  void CheckProfiler(long);
+  int StartProfiler(std::string);
+  void StopProfiler();
+  void PublishMetrics();
+  bool OverBudget(bool);
+  void UpdateWatermark(link_counters_t&, int64_t);
+  std::string RenderMetrics(const metrics_t&, const std::vector<long>&, long, long, long,
+      const std::vector<std::pair<std::string, double>>&);
 
   std::vector<std::unique_ptr<StraxFormatter>> fFormatters;
   std::vector<std::thread> fProcessingThreads;
   std::vector<std::thread> fReadoutThreads;
   std::map<int, std::vector<std::shared_ptr<V1724>>> fDigitizers;
-  std::mutex fMutex;
+  NamedMutex fMutex{"controller"};
 
   std::atomic_bool fReadLoop;
   std::map<int, std::atomic_bool> fRunning;
@@ -58,6 +99,52 @@ private:
   // For reporting to frontend
   std::atomic_int fDataRate;
   std::atomic_long fCounter;
+
+  // High-resolution history, only touched by the status thread
+  std::vector<rate_sample_t> fRateHistory;
+  std::size_t fHistoryHead, fHistorySize;
+  std::chrono::system_clock::time_point fLastSample;
+  long fStatusBytes;
+  double fPeakRate;
+
+  // For the run report
+  std::map<std::string, std::vector<long>> fRunHistograms;
+  std::vector<formatter_stats_t> fRunStats;
+  std::map<std::string, std::map<std::string, long>> fRunLatencies; // stage: {p50: us, ...}
+  std::vector<std::vector<trace_event_t>> fRunTrace; // per thread
+  std::map<int, perf_values_t> fReadoutPerf; // per link
+
+  // Sampling profiler, for whole runs or when the formatters fall behind
+  enum {kProfileOff, kProfileRun, kProfileTrigger};
+  std::unique_ptr<Profiler> fProfiler;
+  std::mutex fProfilerMutex;
+  std::string fLogDir, fProfileFile;
+  int fProfileMode, fProfileHz, fProfileWindow, fProfileTriggers, fProfileMaxTriggers;
+  long fProfileThreshold; // bytes in the formatters' input buffers
+  std::chrono::steady_clock::time_point fProfileUntil;
+  std::atomic_int fRunNumber;
+
+  // Memory budget (bytes) for the formatters, readout pauses above the high water mark
+  long fInputHighWater, fOutputHighWater;
+  double fLowWater; // resume below this fraction of the high water mark
+
+  // Live counters in shared memory for redax-top
+  std::unique_ptr<SharedMetrics> fMetrics;
+  bool fMetricsFailed;
+  std::map<int, link_counters_t> fLinkCounters;
+  std::atomic<int64_t> fWatermark; // ns, minimum over links
+  std::atomic<int64_t> fLatestTime; // ns, newest data from any board
+  int64_t fArmTime; // steady ns, no board clock started before this
+  int64_t fMaxClockLead; // ns, header times further ahead of fArmTime are glitches
+  std::shared_ptr<ChunkSchedule> fSchedule; // only for adaptive chunks
+  std::shared_ptr<Manifest> fManifest;
+  std::shared_ptr<FileWriter> fFileWriter;
+  std::vector<std::pair<int, std::shared_ptr<V1724>>> fMetricsBoards; // link, board
+  std::unique_ptr<MetricsServer> fMetricsServer; // Prometheus
+
+  std::vector<std::pair<std::string, double>> fArmTimings; // ms
+  std::chrono::system_clock::time_point fRunStart;
+  std::string fRunDirectory;
 };
 
 #endif
@@ -0,0 +1,173 @@
+#include "FileWriter.hh"
+#include "MongoLog.hh"
+#include <sys/stat.h>
+#include <sys/ioctl.h>
+#include <linux/fs.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+
+FileWriter::FileWriter(std::shared_ptr<MongoLog>& log) : fLog(log) {
+#ifdef O_TMPFILE
+  fUseTmpfile = true;
+#else
+  fUseTmpfile = false;
+#endif
+  fUseLinks = true;
+  fSync = false;
+  fBytesWritten = fBytesLinked = 0;
+#ifdef FICLONE
+  fUseReflinks = true;
+#else
+  fUseReflinks = false;
+#endif
+}
+
+int FileWriter::MakeDirectory(const std::string& path) {
+  const std::lock_guard<std::mutex> lg(fMutex);
+  if (fDirectories.count(path)) return 0;
+  if (mkdir(path.c_str(), 0755) && errno != EEXIST) {
+    fLog->Entry(MongoLog::Warning, "Can't create %s: %s", path.c_str(), std::strerror(errno));
+    return -1;
+  }
+  fDirectories.insert(path);
+  return 0;
+}
+
+int FileWriter::WriteAll(int fd, const char* data, std::size_t size) {
+  for (std::size_t done = 0; done < size;) {
+    ssize_t n = write(fd, data + done, size - done);
+    if (n < 0 && errno == EINTR) continue;
+    if (n <= 0) return -1;
+    done += n;
+  }
+  fBytesWritten += size;
+  return 0;
+}
+
+int FileWriter::SyncData(int fd, const std::string& path) {
+  if (!fSync || fdatasync(fd) == 0) return 0;
+  fLog->Entry(MongoLog::Warning, "Can't sync %s: %s", path.c_str(), std::strerror(errno));
+  return -1;
+}
+
+int FileWriter::SyncDirectory(const std::string& dir, int ret) {
+  // so the new name survives a crash too. Passes ret through unless that fails
+  if (!fSync || ret < 0) return ret;
+  int fd = open(dir.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  if (fd < 0 || fsync(fd)) {
+    fLog->Entry(MongoLog::Warning, "Can't sync %s: %s", dir.c_str(), std::strerror(errno));
+    ret = -1;
+  }
+  if (fd >= 0) close(fd);
+  return ret;
+}
+
+int FileWriter::Publish(const std::string& dir, const std::string& name, const char* data,
+    std::size_t size) {
+  if (MakeDirectory(dir)) return -1;
+  std::string path = dir + "/" + name;
+  int fd = -1, ret = 0;
+#ifdef O_TMPFILE
+  if (fUseTmpfile) {
+    fd = open(dir.c_str(), O_TMPFILE | O_WRONLY | O_CLOEXEC, 0644);
+    if (fd < 0 && (errno == EOPNOTSUPP || errno == EISDIR || errno == EINVAL)) {
+      fLog->Entry(MongoLog::Local, "No O_TMPFILE in %s, writing through _temp directories",
+          dir.c_str());
+      fUseTmpfile = false;
+    }
+  }
+#endif
+  if (fd >= 0) {
+    // unnamed until it's complete, then one link makes it appear
+    if (WriteAll(fd, data, size) == 0 && SyncData(fd, path) == 0)
+      ret = LinkIn(fd, path);
+    else
+      ret = -1;
+    if (ret < 0)
+      fLog->Entry(MongoLog::Warning, "Can't write %s: %s", path.c_str(), std::strerror(errno));
+    close(fd);
+    return SyncDirectory(dir, ret);
+  }
+  std::string temp_dir = dir + "_temp";
+  if (MakeDirectory(temp_dir)) return -1;
+  std::string temp = temp_dir + "/" + name;
+  fd = open(temp.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+  if (fd < 0 || WriteAll(fd, data, size)) {
+    fLog->Entry(MongoLog::Warning, "Can't write %s: %s", temp.c_str(), std::strerror(errno));
+    if (fd >= 0) close(fd);
+    return -1;
+  }
+  ret = SyncData(fd, temp);
+  close(fd);
+  if (ret) return -1;
+  ret = access(path.c_str(), F_OK) == 0 ? 1 : 0;
+  if (rename(temp.c_str(), path.c_str())) {
+    fLog->Entry(MongoLog::Warning, "Can't rename %s: %s", temp.c_str(), std::strerror(errno));
+    return -1;
+  }
+  return SyncDirectory(dir, ret);
+}
+
+int FileWriter::LinkIn(int fd, const std::string& path) {
+  // give an O_TMPFILE file its name
+  char proc[32];
+  std::snprintf(proc, sizeof(proc), "/proc/self/fd/%d", fd);
+  if (linkat(AT_FDCWD, proc, AT_FDCWD, path.c_str(), AT_SYMLINK_FOLLOW) == 0) return 0;
+  if (errno != EEXIST) return -1;
+  // same as rename would do
+  return unlink(path.c_str()) || linkat(AT_FDCWD, proc, AT_FDCWD, path.c_str(), AT_SYMLINK_FOLLOW) ? -1 : 1;
+}
+
+int FileWriter::Link(const std::string& from, const std::string& dir, const std::string& name,
+    const char* data, std::size_t size) {
+  if (MakeDirectory(dir)) return -1;
+  std::string path = dir + "/" + name;
+  if (fUseLinks) {
+    int ret = -1;
+    if (link(from.c_str(), path.c_str()) == 0)
+      ret = 0;
+    else if (errno == EEXIST && unlink(path.c_str()) == 0 && link(from.c_str(), path.c_str()) == 0)
+      ret = 1;
+    if (ret >= 0) {
+      fBytesLinked += size;
+      return SyncDirectory(dir, ret); // the data was synced with the first name
+    }
+    if (errno == EPERM || errno == EMLINK || errno == EXDEV || errno == EOPNOTSUPP) {
+      fLog->Entry(MongoLog::Local, "No hard links in %s (%s), trying reflinks", dir.c_str(),
+          std::strerror(errno));
+      fUseLinks = false;
+    }
+  }
+#if defined(FICLONE) && defined(O_TMPFILE)
+  if (fUseReflinks && fUseTmpfile) {
+    // shares the blocks but it's a file of its own, published like any other
+    int src = open(from.c_str(), O_RDONLY | O_CLOEXEC), ret = -1;
+    int fd = open(dir.c_str(), O_TMPFILE | O_WRONLY | O_CLOEXEC, 0644);
+    if (src >= 0 && fd >= 0) {
+      if (ioctl(fd, FICLONE, src) == 0 && SyncData(fd, path) == 0 && (ret = LinkIn(fd, path)) >= 0)
+        fBytesLinked += size;
+      else if (errno == EOPNOTSUPP || errno == EINVAL || errno == EXDEV || errno == ENOTTY) {
+        fLog->Entry(MongoLog::Local, "No reflinks in %s (%s), copying", dir.c_str(),
+            std::strerror(errno));
+        fUseReflinks = false;
+      }
+    }
+    if (src >= 0) close(src);
+    if (fd >= 0) close(fd);
+    if (ret >= 0) return SyncDirectory(dir, ret);
+  }
+#endif
+  return Publish(dir, name, data, size);
+}
+
+int FileWriter::CreateEmpty(const std::string& dir, const std::string& name) {
+  if (MakeDirectory(dir)) return -1;
+  std::string path = dir + "/" + name;
+  int fd = open(path.c_str(), O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0644);
+  if (fd < 0) return errno == EEXIST ? 0 : -1;
+  close(fd);
+  return SyncDirectory(dir, 1);
+}
@@ -0,0 +1,58 @@
+#ifndef _FILEWRITER_HH_
+#define _FILEWRITER_HH_
+
+#include <atomic>
+#include <cstddef>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <string>
+
+class MongoLog;
+
+class FileWriter{
+  /*
+    Puts the formatters' files on disk with as few metadata operations as
+    we can manage, since the output is usually a shared filesystem. Every
+    directory is made once per host and remembered, and a file is written
+    unnamed (O_TMPFILE) and then linked in under its name, so it appears
+    complete or not at all without a _temp directory and a rename. Where
+    the filesystem can't do O_TMPFILE we go back to writing <dir>_temp/<name>
+    and renaming it. A file with the same contents as one we already wrote
+    (the overlap goes into both _post and the next _pre) is a hard link to
+    it, or a reflink, or if the filesystem does neither, a second copy.
+    With SetSync every file's data is synced before it gets its name and
+    the directory after, so whoever hears about it next (the manifest)
+    can't claim a file that a crash takes back.
+    One per host, shared by all formatter threads.
+  */
+public:
+  FileWriter(std::shared_ptr<MongoLog>&);
+
+  int MakeDirectory(const std::string& path); // 0 if it's there now
+  // 0 if written, 1 if it replaced a file with the same name, -1 on error
+  int Publish(const std::string& dir, const std::string& name, const char* data, std::size_t size);
+  // dir/name with the same contents as the file at from (which has data)
+  int Link(const std::string& from, const std::string& dir, const std::string& name,
+      const char* data, std::size_t size);
+  // an empty dir/name unless there's one already: 1 if we made it, 0 if not, -1 on error
+  int CreateEmpty(const std::string& dir, const std::string& name);
+  void SetSync(bool sync) {fSync = sync;}
+  bool Sync() {return fSync;}
+  long BytesWritten() {return fBytesWritten;}
+  long BytesLinked() {return fBytesLinked;} // we didn't have to write
+
+private:
+  int WriteAll(int fd, const char* data, std::size_t size);
+  int LinkIn(int fd, const std::string& path);
+  int SyncData(int fd, const std::string& path);
+  int SyncDirectory(const std::string& dir, int ret);
+
+  std::shared_ptr<MongoLog> fLog;
+  std::mutex fMutex;
+  std::set<std::string> fDirectories;
+  std::atomic_bool fUseTmpfile, fUseLinks, fUseReflinks, fSync;
+  std::atomic_long fBytesWritten, fBytesLinked;
+};
+
+#endif // _FILEWRITER_HH_ defined
@@ -0,0 +1,103 @@
+#ifndef _HISTOGRAM_HH_
+#define _HISTOGRAM_HH_
+
+#include <atomic>
+#include <memory>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <limits>
+
+class Histogram{
+  /*
+    Fixed-bucket counter for hot-path statistics. Fill() is two relaxed
+    increments (bucket and sum) plus a compare for the maximum, no
+    allocations or locks, so it's fine per event. Anyone can read the
+    counts at any time (they're just not a consistent snapshot).
+    Linear: nbins buckets of equal width starting at lo.
+    Log2: bucket 0 holds values <= 0, bucket i holds [2^(i-1), 2^i).
+    Log2Fine: like Log2 but each power of 2 is split into 8, so about 10%
+    resolution, good enough for percentiles (values below 8 are exact).
+    Values out of range go into the first or last bucket.
+  */
+public:
+  enum Binning {Linear, Log2, Log2Fine};
+
+  Histogram(Binning binning, int nbins, long lo=0, long width=1) :
+      fBinning(binning), fNBins(std::max(nbins, 1)), fLow(lo),
+      fWidth(std::max(width, 1L)), fBins(std::make_unique<std::atomic_long[]>(fNBins)) {
+    for (int i = 0; i < fNBins; i++) fBins[i] = 0;
+    fMax = std::numeric_limits<long>::min();
+    fSum = 0;
+  }
+
+  void Fill(long value) {
+    fBins[Bucket(value)].fetch_add(1, std::memory_order_relaxed);
+    fSum.fetch_add(value, std::memory_order_relaxed);
+    for (long cur = fMax.load(std::memory_order_relaxed);
+        value > cur && !fMax.compare_exchange_weak(cur, value, std::memory_order_relaxed);) {}
+  }
+
+  int Bucket(long value) const {
+    long b;
+    if (fBinning == Log2) {
+      b = value <= 0 ? 0 : 64 - __builtin_clzl((unsigned long)value);
+    } else if (fBinning == Log2Fine) {
+      if (value < 8) {
+        b = std::max(value, 0L);
+      } else {
+        int e = 63 - __builtin_clzl((unsigned long)value);
+        b = (e-2)*8 + ((value >> (e-3)) & 7);
+      }
+    } else {
+      b = value < fLow ? 0 : (value - fLow)/fWidth;
+    }
+    return std::min<long>(b, fNBins-1);
+  }
+
+  // Lower edge of a bucket
+  long Lower(int bucket) const {
+    if (fBinning == Log2)
+      return bucket == 0 ? 0 : 1L << (bucket-1);
+    if (fBinning == Log2Fine)
+      return bucket < 8 ? bucket : (8L + bucket%8) << (bucket/8 - 1);
+    return fLow + bucket*fWidth;
+  }
+
+  std::string Label(int bucket) const {return std::to_string(Lower(bucket));}
+
+  // Lower edge of the bucket holding the q-th quantile of counts (from AddTo)
+  long Percentile(const std::vector<long>& counts, double q) const {
+    long total = 0, sum = 0;
+    for (auto c : counts) total += c;
+    for (unsigned i = 0; i < counts.size(); i++) {
+      sum += counts[i];
+      if (sum > 0 && sum >= q*total) return Lower(i);
+    }
+    return 0;
+  }
+
+  // Adds the counts into ret (resized if needed) with trailing empty buckets dropped
+  void AddTo(std::vector<long>& ret) const {
+    int last = fNBins;
+    while (last > 0 && fBins[last-1].load(std::memory_order_relaxed) == 0) last--;
+    if ((int)ret.size() < last) ret.resize(last, 0);
+    for (int i = 0; i < last; i++) ret[i] += fBins[i].load(std::memory_order_relaxed);
+  }
+
+  int NBins() const {return fNBins;}
+  // largest value filled, the real one rather than a bucket edge (LONG_MIN if none)
+  long Max() const {return fMax.load(std::memory_order_relaxed);}
+  // sum of the values filled, not of bucket edges
+  long Sum() const {return fSum.load(std::memory_order_relaxed);}
+
+private:
+  Binning fBinning;
+  int fNBins;
+  long fLow, fWidth;
+  std::unique_ptr<std::atomic_long[]> fBins;
+  std::atomic_long fMax;
+  std::atomic_long fSum;
+};
+
+#endif // _HISTOGRAM_HH_ defined
@@ -0,0 +1,142 @@
+#include "LogSink.hh"
+#include <iostream>
+#include <sstream>
+#include <iomanip>
+#include <algorithm>
+
+namespace fs=std::experimental::filesystem;
+
+static const std::vector<std::string> kPriorities{"LOCAL", "DEBUG", "MESSAGE",
+  "WARNING", "ERROR", "FATAL"};
+
+std::string LogSink::FormatTime(struct tm* date) {
+  std::stringstream s;
+  s <<std::put_time(date, "%F %T");
+  return s.str();
+}
+
+std::string LogSink::FormatRecord(const log_record& rec) {
+  // the timestamp only changes once a second, no need to redo it every line
+  thread_local std::time_t last_time = -1;
+  thread_local std::string last_formatted;
+  if (rec.time != last_time) {
+    struct tm tm;
+    gmtime_r(&rec.time, &tm);
+    last_formatted = FormatTime(&tm);
+    last_time = rec.time;
+  }
+  const std::string& priority = kPriorities[rec.priority+1];
+  std::string line;
+  line.reserve(last_formatted.size() + priority.size() + rec.message.size() + 6);
+  line += last_formatted;
+  line += " [";
+  line += priority;
+  line += "]: ";
+  line += rec.message;
+  line += '\n';
+  return line;
+}
+
+FileSink::FileSink(std::string log_dir, std::string host, int DeleteAfterDays, bool echo) {
+  fOutputDir = log_dir;
+  fHostname = host;
+  fDeleteAfterDays = DeleteAfterDays;
+  fEcho = echo;
+  std::cout<<"Configured WITH local file logging to " << log_dir << std::endl;
+  RotateLogFile();
+}
+
+FileSink::~FileSink() {
+  fOutfile.close();
+}
+
+int FileSink::Today(struct tm* date) {
+  return (date->tm_year+1900)*10000 + (date->tm_mon+1)*100 + (date->tm_mday);
+}
+
+std::string FileSink::LogFileName(struct tm* date) {
+  return std::to_string(Today(date)) + "_" + fHostname + ".log";
+}
+
+int FileSink::RotateLogFile() {
+  if (fOutfile.is_open()) fOutfile.close();
+  auto t = std::time(0);
+  auto today = *std::gmtime(&t);
+  std::string filename = LogFileName(&today);
+  std::cout<<"Logging to " << fOutputDir/filename<<std::endl;
+  fOutfile.open(fOutputDir / filename, std::ofstream::out | std::ofstream::app);
+  if (!fOutfile.is_open()) {
+    std::cout << "Could not rotate logfile!\n";
+    return -1;
+  }
+  fOutfile << FormatTime(&today) << " [INIT]: logfile initialized\n";
+  fToday = Today(&today);
+  std::vector<int> days_per_month = {31,28,31,30,31,30,31,31,30,31,30,31};
+  if (today.tm_year%4 == 0) days_per_month[1] += 1; // the edge-case is SEP
+  struct tm last_week = today;
+  last_week.tm_mday -= fDeleteAfterDays;
+  if (last_week.tm_mday <= 0) { // new month
+    last_week.tm_mon--;
+    if (last_week.tm_mon < 0) { // new year
+      last_week.tm_year--;
+      last_week.tm_mon = 11;
+    }
+    last_week.tm_mday += days_per_month[last_week.tm_mon]; // off by one error???
+  }
+  fs::path p = fOutputDir/LogFileName(&last_week);
+  if (fs::exists(p)) {
+    fOutfile << FormatTime(&today) << " [INIT]: Deleting " << p << '\n';
+    fs::remove(p);
+  } else {
+    fOutfile << FormatTime(&today) << " [INIT]: No older logfile to delete :(\n";
+  }
+  return 0;
+}
+
+void FileSink::Write(const std::vector<log_record>& batch) {
+  struct tm tm;
+  std::time_t last_time = -1;
+  for (auto& rec : batch) {
+    if (rec.time != last_time) {
+      gmtime_r(&rec.time, &tm);
+      if (Today(&tm) != fToday) RotateLogFile();
+      last_time = rec.time;
+    }
+    std::string line = FormatRecord(rec);
+    if (fEcho) std::cout << line;
+    fOutfile << line;
+  }
+  if (fEcho) std::cout << std::flush;
+}
+
+void FileSink::Flush() {
+  if (fOutfile.is_open()) fOutfile << std::flush;
+}
+
+MemorySink::MemorySink(std::size_t capacity) {
+  fCapacity = std::max<std::size_t>(capacity, 1);
+  fRecords.reserve(fCapacity);
+  fHead = 0;
+  fTotal = 0;
+}
+
+void MemorySink::Write(const std::vector<log_record>& batch) {
+  const std::lock_guard<NamedMutex> lk(fMutex);
+  for (auto& rec : batch) {
+    if (fRecords.size() < fCapacity) {
+      fRecords.push_back(rec);
+    } else {
+      fRecords[fHead] = rec;
+      fHead = (fHead + 1) % fRecords.size();
+    }
+    fTotal++;
+  }
+}
+
+std::vector<log_record> MemorySink::Contents() {
+  // oldest first
+  const std::lock_guard<NamedMutex> lk(fMutex);
+  std::vector<log_record> ret(fRecords.begin() + fHead, fRecords.end());
+  ret.insert(ret.end(), fRecords.begin(), fRecords.begin() + fHead);
+  return ret;
+}
@@ -0,0 +1,89 @@
+#ifndef _LOGSINK_HH_
+#define _LOGSINK_HH_
+
+#include <ctime>
+#include <string>
+#include <vector>
+#include <fstream>
+#include <mutex>
+#include <memory>
+#include <experimental/filesystem>
+#include "NamedMutex.hh"
+
+struct log_record {
+  int priority;
+  int runid;
+  std::time_t time;
+  std::string message;
+};
+
+class LogSink{
+  /*
+    Somewhere for MongoLog to put its messages. Write() is only ever called
+    from the MongoLog writer thread, with a batch of records in the order
+    they were logged.
+  */
+public:
+  LogSink() {}
+  virtual ~LogSink() {}
+
+  virtual void Write(const std::vector<log_record>&) = 0;
+  virtual void Flush() {}
+
+  static std::string FormatTime(struct tm* date);
+  static std::string FormatRecord(const log_record&);
+};
+
+class FileSink : public LogSink{
+  /*
+    Daily logfiles in a local directory, older ones deleted after some days.
+    Optionally echoes everything to stdout.
+  */
+public:
+  FileSink(std::string, std::string, int, bool=true);
+  virtual ~FileSink();
+
+  virtual void Write(const std::vector<log_record>&);
+  virtual void Flush();
+
+private:
+  int Today(struct tm* date);
+  int RotateLogFile();
+  std::string LogFileName(struct tm* date);
+
+  std::ofstream fOutfile;
+  std::experimental::filesystem::path fOutputDir;
+  std::string fHostname;
+  int fDeleteAfterDays;
+  int fToday;
+  bool fEcho;
+};
+
+class NullSink : public LogSink{
+public:
+  NullSink() {}
+  virtual ~NullSink() {}
+  virtual void Write(const std::vector<log_record>&) {}
+};
+
+class MemorySink : public LogSink{
+  /*
+    Keeps the most recent N records in memory, for when you want to look
+    at the log without paying for any I/O
+  */
+public:
+  MemorySink(std::size_t=1024);
+  virtual ~MemorySink() {}
+
+  virtual void Write(const std::vector<log_record>&);
+  std::vector<log_record> Contents();
+  long Total() {return fTotal;}
+
+private:
+  NamedMutex fMutex{"log_memory_sink"};
+  std::vector<log_record> fRecords;
+  std::size_t fCapacity, fHead;
+  long fTotal;
+};
+
+#endif // _LOGSINK_HH_ defined
@@ -0,0 +1,63 @@
+#include "Manifest.hh"
+#include "MongoLog.hh"
+#include <fcntl.h>
+#include <unistd.h>
+#include <chrono>
+#include <cstring>
+#include <stdexcept>
+
+static int64_t Now() {
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(
+      std::chrono::system_clock::now().time_since_epoch()).count();
+}
+
+Manifest::Manifest(const std::string& run_dir, const std::string& host, double fsync_interval,
+    std::shared_ptr<MongoLog>& log) : fLog(log) {
+  fHost = host;
+  fFileName = run_dir + "/" + host + "_manifest.jsonl";
+  fSyncInterval = fsync_interval < 0 ? -1 : int64_t(fsync_interval*1e9);
+  fLastSync = Now();
+  fRecords = 0;
+  fFailed = false;
+  fFD = open(fFileName.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_APPEND | O_CLOEXEC, 0644);
+  if (fFD < 0)
+    throw std::runtime_error("Can't write " + fFileName + ": " + std::strerror(errno));
+}
+
+Manifest::~Manifest() {
+  if (fFD >= 0) close(fFD);
+}
+
+void Manifest::Add(const std::string& chunk, const std::string& file, long bytes,
+    const std::string& fields) {
+  Write("{\"chunk\": \"" + chunk + "\", \"file\": \"" + file + "\", \"bytes\": " +
+      std::to_string(bytes) + ", \"time\": " + std::to_string(Now()/1000000) +
+      (fields.empty() ? "" : ", " + fields) + "}\n");
+}
+
+void Manifest::End(int threads) {
+  Write("{\"end\": true, \"host\": \"" + fHost + "\", \"threads\": " + std::to_string(threads) +
+      ", \"files\": " + std::to_string(fRecords) + ", \"time\": " + std::to_string(Now()/1000000) +
+      "}\n");
+  if (fdatasync(fFD))
+    fLog->Entry(MongoLog::Warning, "Can't sync %s: %s", fFileName.c_str(), std::strerror(errno));
+}
+
+void Manifest::Write(const std::string& line) {
+  const std::lock_guard<std::mutex> lg(fMutex);
+  // one write per line, so a reader never sees half of one from another thread
+  if (write(fFD, line.data(), line.size()) != (ssize_t)line.size()) {
+    if (!fFailed)
+      fLog->Entry(MongoLog::Warning, "Can't write to %s: %s", fFileName.c_str(), std::strerror(errno));
+    fFailed = true;
+    return;
+  }
+  fRecords++;
+  if (fSyncInterval < 0) return;
+  int64_t now = Now();
+  if (now - fLastSync >= fSyncInterval) {
+    if (fdatasync(fFD))
+      fLog->Entry(MongoLog::Warning, "Can't sync %s: %s", fFileName.c_str(), std::strerror(errno));
+    fLastSync = now;
+  }
+}
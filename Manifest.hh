@@ -0,0 +1,44 @@
+#ifndef _MANIFEST_HH_
+#define _MANIFEST_HH_
+
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+
+class MongoLog;
+
+class Manifest{
+  /*
+    Append-only record of every file this host finishes in a run, so
+    consumers can follow <run>/<host>_manifest.jsonl instead of scanning
+    the chunk directories. One JSON object per line, written with a single
+    write() after the file it describes was renamed into place, and a last
+    line {"end": true, ...} once all threads are done.
+    fsync_interval: 0 syncs after every line, >0 at most every that many
+    seconds (as long as lines keep coming), <0 only at the end. Only with 0
+    are the files themselves synced first (see FileWriter::SetSync),
+    otherwise after a crash a line can be there for a file that isn't.
+  */
+public:
+  Manifest(const std::string& run_dir, const std::string& host, double fsync_interval,
+      std::shared_ptr<MongoLog>&);
+  ~Manifest();
+
+  // fields: more "key": value pairs for the line, if any
+  void Add(const std::string& chunk, const std::string& file, long bytes, const std::string& fields="");
+  void End(int threads);
+
+private:
+  void Write(const std::string& line);
+
+  int fFD;
+  std::string fFileName, fHost;
+  int64_t fSyncInterval, fLastSync; // ns
+  long fRecords;
+  bool fFailed;
+  std::mutex fMutex;
+  std::shared_ptr<MongoLog> fLog;
+};
+
+#endif // _MANIFEST_HH_ defined
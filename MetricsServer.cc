@@ -0,0 +1,108 @@
+#include "MetricsServer.hh"
+#include "MongoLog.hh"
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <netdb.h>
+#include <poll.h>
+#include <unistd.h>
+#include <cerrno>
+#include <cstring>
+
+MetricsServer::MetricsServer(std::shared_ptr<MongoLog>& log) : fLog(log) {
+  fSocket = -1;
+  fRun = false;
+}
+
+MetricsServer::~MetricsServer() {
+  fRun = false;
+  if (fThread.joinable()) fThread.join();
+  if (fSocket >= 0) close(fSocket);
+}
+
+int MetricsServer::Listen(const std::string& address) {
+  auto colon = address.rfind(':');
+  if (colon == std::string::npos) {
+    fLog->Entry(MongoLog::Warning, "Metrics address should be host:port, not %s", address.c_str());
+    return -1;
+  }
+  std::string host = address.substr(0, colon), port = address.substr(colon+1);
+  if (host == "") host = "127.0.0.1";
+  struct addrinfo hints, *res = nullptr;
+  std::memset(&hints, 0, sizeof(hints));
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+  hints.ai_flags = AI_PASSIVE;
+  if (int err = getaddrinfo(host.c_str(), port.c_str(), &hints, &res)) {
+    fLog->Entry(MongoLog::Warning, "Can't resolve metrics address %s: %s", address.c_str(),
+        gai_strerror(err));
+    return -1;
+  }
+  for (auto ai = res; ai != nullptr && fSocket < 0; ai = ai->ai_next) {
+    fSocket = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+    if (fSocket < 0) continue;
+    int one = 1;
+    setsockopt(fSocket, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    if (bind(fSocket, ai->ai_addr, ai->ai_addrlen) || listen(fSocket, 4)) {
+      close(fSocket);
+      fSocket = -1;
+    }
+  }
+  freeaddrinfo(res);
+  if (fSocket < 0) {
+    fLog->Entry(MongoLog::Warning, "Can't listen for metrics on %s: %s", address.c_str(),
+        std::strerror(errno));
+    return -1;
+  }
+  fRun = true;
+  fThread = std::thread(&MetricsServer::Serve, this);
+  fLog->Entry(MongoLog::Local, "Serving metrics on http://%s/metrics", address.c_str());
+  return 0;
+}
+
+void MetricsServer::Update(std::string text) {
+  const std::lock_guard<std::mutex> lg(fMutex);
+  fText.swap(text);
+}
+
+void MetricsServer::Serve() {
+  struct pollfd pfd{fSocket, POLLIN, 0};
+  while (fRun) {
+    // wake up now and then to see if we should stop
+    if (poll(&pfd, 1, 250) <= 0) continue;
+    int fd = accept(fSocket, nullptr, nullptr);
+    if (fd < 0) continue;
+    // a stuck client shouldn't hold us up for long
+    struct timeval tv{1, 0};
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+    Respond(fd);
+    close(fd);
+  }
+}
+
+void MetricsServer::Respond(int fd) {
+  std::string request;
+  char buf[1024];
+  while (request.find("\r\n\r\n") == std::string::npos && request.size() < 8192) {
+    ssize_t n = recv(fd, buf, sizeof(buf), 0);
+    if (n <= 0) return;
+    request.append(buf, n);
+  }
+  std::string body, status = "200 OK";
+  if (request.rfind("GET /metrics ", 0) == 0 || request.rfind("GET /metrics?", 0) == 0) {
+    const std::lock_guard<std::mutex> lg(fMutex);
+    body = fText;
+  } else {
+    status = "404 Not Found";
+    body = "Try /metrics\n";
+  }
+  std::string response = "HTTP/1.1 " + status + "\r\n"
+    "Content-Type: text/plain; version=0.0.4\r\n"
+    "Content-Length: " + std::to_string(body.size()) + "\r\n"
+    "Connection: close\r\n\r\n" + body;
+  for (std::size_t sent = 0; sent < response.size();) {
+    ssize_t n = send(fd, response.data() + sent, response.size() - sent, MSG_NOSIGNAL);
+    if (n <= 0) return;
+    sent += n;
+  }
+}
@@ -0,0 +1,41 @@
+#ifndef _METRICSSERVER_HH_
+#define _METRICSSERVER_HH_
+
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+
+class MongoLog;
+
+class MetricsServer{
+  /*
+    Minimal HTTP listener for Prometheus: GET /metrics returns whatever text
+    was last handed to Update(), everything else is a 404. It has its own
+    thread and never looks at the DAQ itself, the status thread renders the
+    text from the same counters it already samples.
+    One request per connection, one connection at a time, which is plenty
+    for a scraper every few seconds.
+  */
+public:
+  MetricsServer(std::shared_ptr<MongoLog>&);
+  ~MetricsServer();
+
+  // "host:port" or ":port" (which means localhost)
+  int Listen(const std::string& address);
+  void Update(std::string text);
+
+private:
+  void Serve();
+  void Respond(int fd);
+
+  std::shared_ptr<MongoLog> fLog;
+  int fSocket;
+  std::atomic_bool fRun;
+  std::thread fThread;
+  std::mutex fMutex;
+  std::string fText;
+};
+
+#endif // _METRICSSERVER_HH_ defined
@@ -1,132 +1,438 @@
 #include "MongoLog.hh"
 #include <iostream>
 #include <chrono>
-#include <bsoncxx/builder/stream/document.hpp>
+#include <climits>
+#include <pthread.h>
 
-MongoLog::MongoLog(int DeleteAfterDays, std::shared_ptr<mongocxx::pool>& pool, std::string dbname, std::string log_dir, std::string host) : 
-  fPool(pool), fClient(pool->acquire()) {
-  fLogLevel = 0;
-  fHostname = host;
-  fDeleteAfterDays = DeleteAfterDays;
+namespace {
+// One conversion in a printf-style format string
+struct conversion_t {
+  const char* start; // the '%'
+  const char* end; // one past the conversion character
+  int stars; // '*' width and/or precision, each takes an int argument
+  int longs; // l, ll, j, z, t
+  bool long_double;
+  char type;
+};
+
+// Finds the next conversion at or after fmt, skipping "%%". Returns 1 if one
+// was found (and advances fmt past it), 0 at the end of the string, and -1 if
+// there's something we don't understand (eg %n)
+int NextConversion(const char*& fmt, conversion_t& conv) {
+  for (const char* c = fmt; *c != '\0'; c++) {
+    if (*c != '%') continue;
+    if (*(c+1) == '%') {
+      c++;
+      continue;
+    }
+    conv.start = c++;
+    conv.stars = conv.longs = 0;
+    conv.long_double = false;
+    while (*c != '\0' && std::strchr("-+ #0", *c)) c++; // flags
+    for (; (*c >= '0' && *c <= '9') || *c == '*' || *c == '.'; c++) // width, precision
+      if (*c == '*') conv.stars++;
+    for (; *c != '\0' && std::strchr("hljztL", *c); c++) { // length
+      if (*c == 'L') conv.long_double = true;
+      else if (*c != 'h') conv.longs++;
+    }
+    if (*c == '\0' || conv.stars > 2 || !std::strchr("diuxXocsfFeEgGaAp", *c)) return -1;
+    conv.type = *c;
+    conv.end = fmt = c+1;
+    return 1;
+  }
+  return 0;
+}
+
+bool IsInteger(char type) {
+  return std::strchr("diuxXoc", type) != nullptr;
+}
+
+// Walks a printf-style format string and pulls the matching integer arguments
+// out of the va_list, calling f(index, value) for each of them. Non-integer
+// arguments are consumed but not reported.
+template<typename F>
+void ForEachIntArg(const char* fmt, va_list args, F&& f) {
+  conversion_t conv;
+  for (int idx = 0; NextConversion(fmt, conv) == 1; idx++) {
+    for (int i = 0; i < conv.stars; i++) va_arg(args, int);
+    if (IsInteger(conv.type))
+      f(idx, conv.longs > 0 ? va_arg(args, long) : long(va_arg(args, int)));
+    else if (conv.type == 's' || conv.type == 'p')
+      va_arg(args, void*);
+    else if (conv.long_double)
+      va_arg(args, long double);
+    else
+      va_arg(args, double);
+  }
+}
+
+// Copies the arguments of a printf-style call into a flat buffer so they can
+// be formatted later (strings are copied, not just their pointers). Returns
+// the number of bytes used, or -1 if they don't fit or the format has
+// something unsupported in it.
+int PackArgs(const char* fmt, va_list args, char* buf, std::size_t size) {
+  conversion_t conv;
+  std::size_t pos = 0;
+  auto put = [&](const void* src, std::size_t n) {
+    if (pos + n > size) return false;
+    std::memcpy(buf + pos, src, n);
+    pos += n;
+    return true;
+  };
+  int ret;
+  while ((ret = NextConversion(fmt, conv)) == 1) {
+    bool ok = true;
+    for (int i = 0; i < conv.stars; i++) {
+      int star = va_arg(args, int);
+      ok &= put(&star, sizeof(star));
+    }
+    if (IsInteger(conv.type)) {
+      long val = conv.longs > 0 ? va_arg(args, long) : long(va_arg(args, int));
+      ok &= put(&val, sizeof(val));
+    } else if (conv.type == 's') {
+      const char* val = va_arg(args, const char*);
+      if (val == nullptr) val = "(null)";
+      ok &= put(val, std::strlen(val)+1);
+    } else if (conv.type == 'p') {
+      void* val = va_arg(args, void*);
+      ok &= put(&val, sizeof(val));
+    } else if (conv.long_double) {
+      long double val = va_arg(args, long double);
+      ok &= put(&val, sizeof(val));
+    } else {
+      double val = va_arg(args, double);
+      ok &= put(&val, sizeof(val));
+    }
+    if (!ok) return -1;
+  }
+  return ret == 0 ? int(pos) : -1;
+}
+
+// spec is one conversion cut out of a literal format, checked at its call site
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wformat-nonliteral"
+template<typename T>
+int PrintOne(char* buf, std::size_t size, const char* spec, int stars, const int* star, T val) {
+  if (stars == 0) return std::snprintf(buf, size, spec, val);
+  if (stars == 1) return std::snprintf(buf, size, spec, star[0], val);
+  return std::snprintf(buf, size, spec, star[0], star[1], val);
+}
+#pragma GCC diagnostic pop
+
+void AppendLiteral(std::string& out, const char* from, const char* to) {
+  for (; from < to; from++) {
+    out += *from;
+    if (*from == '%') from++; // "%%"
+  }
+}
+
+// The inverse of PackArgs, one conversion at a time
+std::string FormatPacked(const char* fmt, const char* data) {
+  std::string out;
+  conversion_t conv;
+  char spec[32], tmp[256];
+  const char* literal = fmt;
+  auto get = [&](auto& val) {
+    std::memcpy(&val, data, sizeof(val));
+    data += sizeof(val);
+  };
+  while (NextConversion(fmt, conv) == 1) {
+    AppendLiteral(out, literal, conv.start);
+    literal = conv.end;
+    std::size_t n = std::min<std::size_t>(conv.end - conv.start, sizeof(spec)-1);
+    std::memcpy(spec, conv.start, n);
+    spec[n] = '\0';
+    int star[2] = {0, 0};
+    for (int i = 0; i < conv.stars; i++) get(star[i]);
+    if (conv.type == 's') { // no need to go through a buffer with this one
+      if (conv.stars == 0 && n == 2) out += data;
+      else {
+        int len = PrintOne(nullptr, 0, spec, conv.stars, star, data);
+        std::size_t offset = out.size();
+        out.resize(offset + len + 1);
+        PrintOne(&out[offset], len+1, spec, conv.stars, star, data);
+        out.resize(offset + len);
+      }
+      data += std::strlen(data)+1;
+      continue;
+    }
+    int len = 0;
+    if (IsInteger(conv.type)) {
+      long val;
+      get(val);
+      if (conv.longs > 0) len = PrintOne(tmp, sizeof(tmp), spec, conv.stars, star, val);
+      else len = PrintOne(tmp, sizeof(tmp), spec, conv.stars, star, int(val));
+    } else if (conv.type == 'p') {
+      void* val;
+      get(val);
+      len = PrintOne(tmp, sizeof(tmp), spec, conv.stars, star, val);
+    } else if (conv.long_double) {
+      long double val;
+      get(val);
+      len = PrintOne(tmp, sizeof(tmp), spec, conv.stars, star, val);
+    } else {
+      double val;
+      get(val);
+      len = PrintOne(tmp, sizeof(tmp), spec, conv.stars, star, val);
+    }
+    out.append(tmp, std::min<std::size_t>(std::max(len, 0), sizeof(tmp)-1));
+  }
+  AppendLiteral(out, literal, literal + std::strlen(literal));
+  return out;
+}
+} // namespace
+
+MongoLog::MongoLog(std::vector<std::unique_ptr<LogSink>>& sinks) {
+  fSinks = std::move(sinks);
+  Start();
+}
+
+void MongoLog::Start() {
   fFlushPeriod = 5; // seconds
-  fOutputDir = log_dir;
-  //fPool = pool;
-  //fClient = pool->acquire();
-  fDB = (*fClient)[dbname];
-  fCollection = fDB["log"];
-
-  std::cout<<"Configured WITH local file logging to " << log_dir << std::endl;
-  fFlush = true;
-  fFlushThread = std::thread(&MongoLog::Flusher, this);
   fRunId = -1;
 
-  RotateLogFile();
+  const std::size_t ring_size = 1 << 14; // must be a power of 2
+  fRing = std::make_unique<slot_t[]>(ring_size);
+  for (std::size_t i = 0; i < ring_size; i++) fRing[i].sequence = i;
+  fRingMask = ring_size - 1;
+  fBatchSize = 256;
+  fEnqueuePos = fDequeuePos = 0;
+  fDropped = fTotalDropped = 0;
 
-  fLogLevel = 1;
+  const std::size_t n_sites = 1 << 8;
+  fCallSites = std::make_unique<call_site_t[]>(n_sites);
+  fCallSiteMask = n_sites - 1;
+  for (std::size_t i = 0; i < n_sites; i++) {
+    fCallSites[i].format = nullptr;
+    ResetCallSite(&fCallSites[i]);
+  }
+  fRateLimitCount = 10;
+  fRateLimitPeriod = 10; // seconds
+  fTotalSuppressed = 0;
+
+  fRunning = true;
+  fWriteThread = std::thread(&MongoLog::Writer, this);
 }
 
 MongoLog::~MongoLog(){
-  fFlush = false;
-  fFlushThread.join();
-  fOutfile.close();
+  fRunning = false;
+  fWriteThread.join();
+  fSinks.clear();
 }
 
-void MongoLog::Flusher() {
-  while (fFlush == true) {
-    std::this_thread::sleep_for(std::chrono::seconds(fFlushPeriod));
-    fMutex.lock();
-    if (fOutfile.is_open()) fOutfile << std::flush;
-    fMutex.unlock();
+bool MongoLog::Push(int priority, const char* format, const char* data, std::size_t length) {
+  // called from any thread
+  slot_t* slot;
+  std::size_t pos = fEnqueuePos.load(std::memory_order_relaxed);
+  while (true) {
+    slot = &fRing[pos & fRingMask];
+    std::size_t seq = slot->sequence.load(std::memory_order_acquire);
+    long diff = (long)seq - (long)pos;
+    if (diff == 0) {
+      if (fEnqueuePos.compare_exchange_weak(pos, pos+1, std::memory_order_relaxed))
+        break;
+    } else if (diff < 0) {
+      return false; // full
+    } else {
+      pos = fEnqueuePos.load(std::memory_order_relaxed);
+    }
+  }
+  slot->priority = priority;
+  slot->runid = fRunId;
+  slot->time = std::time(nullptr);
+  slot->format = format;
+  if (length <= kSlotBytes) {
+    std::memcpy(slot->data, data, length);
+    slot->length = length;
+  } else {
+    slot->overflow = std::make_unique<std::string>(data, length);
   }
+  slot->sequence.store(pos+1, std::memory_order_release);
+  return true;
 }
 
-std::string MongoLog::FormatTime(struct tm* date) {
-  std::stringstream s;
-  s <<std::put_time(date, "%F %T");
-  return s.str();
+bool MongoLog::Pop(log_record& rec) {
+  // writer thread only
+  slot_t* slot = &fRing[fDequeuePos & fRingMask];
+  std::size_t seq = slot->sequence.load(std::memory_order_acquire);
+  if ((long)seq - (long)(fDequeuePos+1) < 0) return false; // empty
+  rec.priority = slot->priority;
+  rec.runid = slot->runid;
+  rec.time = slot->time;
+  if (slot->format != nullptr) {
+    rec.message = FormatPacked(slot->format, slot->data);
+  } else if (slot->overflow) {
+    rec.message = std::move(*slot->overflow);
+    slot->overflow.reset();
+  } else {
+    rec.message.assign(slot->data, slot->length);
+  }
+  slot->sequence.store(fDequeuePos + fRingMask + 1, std::memory_order_release);
+  fDequeuePos++;
+  return true;
 }
 
-int MongoLog::Today(struct tm* date) {
-  return (date->tm_year+1900)*10000 + (date->tm_mon+1)*100 + (date->tm_mday);
+void MongoLog::Writer() {
+  using namespace std::chrono;
+  pthread_setname_np(pthread_self(), "redax_log");
+  std::vector<log_record> batch;
+  batch.reserve(fBatchSize);
+  log_record rec;
+  auto last_flush = steady_clock::now(), last_summary = last_flush;
+  while (fRunning == true || fEnqueuePos.load() != fDequeuePos) {
+    while (batch.size() < fBatchSize && Pop(rec)) batch.emplace_back(std::move(rec));
+    if (long dropped = fDropped.exchange(0); dropped > 0) {
+      batch.push_back({Warning, fRunId, std::time(nullptr),
+          "Log buffer full, dropped " + std::to_string(dropped) + " messages"});
+    }
+    if (steady_clock::now() - last_summary > seconds(fRateLimitPeriod)) {
+      SummarizeSuppressed(batch, duration_cast<seconds>(steady_clock::now() - last_summary).count());
+      last_summary = steady_clock::now();
+    }
+    if (batch.size() > 0) {
+      WriteBatch(batch);
+      batch.clear();
+    } else {
+      std::this_thread::sleep_for(milliseconds(10));
+    }
+    if (steady_clock::now() - last_flush > seconds(fFlushPeriod)) {
+      for (auto& sink : fSinks) sink->Flush();
+      last_flush = steady_clock::now();
+    }
+  }
+  SummarizeSuppressed(batch, duration_cast<seconds>(steady_clock::now() - last_summary).count());
+  if (batch.size() > 0) WriteBatch(batch);
+  for (auto& sink : fSinks) sink->Flush();
 }
 
-std::string MongoLog::LogFileName(struct tm* date) {
-  return std::to_string(Today(date)) + "_" + fHostname + ".log";
+MongoLog::call_site_t* MongoLog::GetCallSite(const char* format, int priority) {
+  // Fibonacci hash of the pointer, then linear probing. Returns nullptr if
+  // the table is full, in which case that site just isn't limited
+  std::size_t idx = (std::size_t(format) * 0x9E3779B97F4A7C15ul) >> 32;
+  for (std::size_t i = 0; i <= fCallSiteMask; i++, idx++) {
+    call_site_t* site = &fCallSites[idx & fCallSiteMask];
+    const char* key = site->format.load(std::memory_order_acquire);
+    if (key == format) return site;
+    if (key == nullptr) {
+      if (site->format.compare_exchange_strong(key, format)) {
+        site->priority = priority;
+        return site;
+      }
+      if (key == format) return site;
+    }
+  }
+  return nullptr;
 }
 
-int MongoLog::RotateLogFile() {
-  if (fOutfile.is_open()) fOutfile.close();
-  auto t = std::time(0);
-  auto today = *std::gmtime(&t);
-  std::string filename = LogFileName(&today);
-  std::cout<<"Logging to " << fOutputDir/filename<<std::endl;
-  fOutfile.open(fOutputDir / filename, std::ofstream::out | std::ofstream::app);
-  if (!fOutfile.is_open()) {
-    std::cout << "Could not rotate logfile!\n";
-    return -1;
+void MongoLog::ResetCallSite(call_site_t* site) {
+  site->count = site->suppressed = 0;
+  site->n_params = 0;
+  for (int i = 0; i < kMaxTrackedParams; i++) {
+    site->min[i] = LONG_MAX;
+    site->max[i] = LONG_MIN;
   }
-  fOutfile << FormatTime(&today) << " [INIT]: logfile initialized\n";
-  fToday = Today(&today);
-  std::vector<int> days_per_month = {31,28,31,30,31,30,31,31,30,31,30,31};
-  if (today.tm_year%4 == 0) days_per_month[1] += 1; // the edge-case is SEP
-  struct tm last_week = today;
-  last_week.tm_mday -= fDeleteAfterDays;
-  if (last_week.tm_mday <= 0) { // new month
-    last_week.tm_mon--;
-    if (last_week.tm_mon < 0) { // new year
-      last_week.tm_year--;
-      last_week.tm_mon = 11;
-    }
-    last_week.tm_mday += days_per_month[last_week.tm_mon]; // off by one error???
-  }
-  std::experimental::filesystem::path p = fOutputDir/LogFileName(&last_week);
-  if (std::experimental::filesystem::exists(p)) {
-    fOutfile << FormatTime(&today) << " [INIT]: Deleting " << p << '\n';
-    std::experimental::filesystem::remove(p);
-  } else {
-    fOutfile << FormatTime(&today) << " [INIT]: No older logfile to delete :(\n";
+}
+
+void MongoLog::SummarizeSuppressed(std::vector<log_record>& batch, int period) {
+  // writer thread only
+  for (std::size_t i = 0; i <= fCallSiteMask; i++) {
+    call_site_t* site = &fCallSites[i];
+    if (site->format.load(std::memory_order_acquire) == nullptr) continue;
+    long suppressed = site->suppressed.load();
+    if (suppressed == 0) {
+      site->count = 0;
+      continue;
+    }
+    std::stringstream msg;
+    msg << "Message \"" << site->format.load() << "\" repeated " << site->count <<
+      " times in " << period << " s (" << suppressed << " suppressed)";
+    int n_params = std::min<int>(site->n_params, kMaxTrackedParams);
+    for (int p = 0; p < n_params; p++) {
+      if (site->min[p] > site->max[p]) continue;
+      msg << ", param " << p << ": " << site->min[p] << ".." << site->max[p];
+    }
+    batch.push_back({site->priority, fRunId, std::time(nullptr), msg.str()});
+    ResetCallSite(site);
   }
-  return 0;
 }
 
-int MongoLog::Entry(int priority, std::string message, ...){
+void MongoLog::WriteBatch(std::vector<log_record>& batch) {
+  for (auto& sink : fSinks) sink->Write(batch);
+}
+
+int MongoLog::Entry(int priority, const char* format, ...){
+  va_list args;
+  va_start(args, format);
+  int ret = VEntry(priority, format, false, args);
+  va_end(args);
+  return ret;
+}
 
-  // Thanks Martin
-  // http://www.martinbroadhurst.com/string-formatting-in-c.html
+int MongoLog::LimitedEntry(int priority, const char* format, ...){
   va_list args;
-  va_start (args, message); // First pass just gets what the length will be
-  size_t len = std::vsnprintf(NULL, 0, message.c_str(), args);
-  va_end (args);
-  std::vector<char> vec(len + 1); // Declare with proper length
-  va_start (args, message);  // Fill the vector we just made
-  std::vsnprintf(&vec[0], len + 1, message.c_str(), args);
-  va_end (args);
-  message = &vec[0];
-
-  auto t = std::time(nullptr);
-  auto tm = *std::gmtime(&t);
-  std::stringstream msg;
-  msg<<FormatTime(&tm)<<" ["<<fPriorities[priority+1] <<"]: "<<message<<std::endl;
-  std::unique_lock<std::mutex> lg(fMutex);
-  std::cout << msg.str();
-  if (Today(&tm) != fToday) RotateLogFile();
-  fOutfile<<msg.str();
-  if(priority >= fLogLevel){
-    try{
-      auto d = bsoncxx::builder::stream::document{} <<
-        "user" << fHostname <<
-        "message" << message <<
-        "priority" << priority <<
-        "runid" << fRunId <<
-        bsoncxx::builder::stream::finalize;
-      fCollection.insert_one(std::move(d));
-    }
-    catch(const std::exception &e){
-      std::cout<<"Failed to insert log message "<<message<<" ("<<
-	priority<<")"<<std::endl;
-      return -1;
+  va_start(args, format);
+  int ret = VEntry(priority, format, true, args);
+  va_end(args);
+  return ret;
+}
+
+int MongoLog::VEntry(int priority, const char* format, bool limited, va_list args){
+  va_list copy;
+  if (limited && priority < Error && fRateLimitCount > 0) {
+    call_site_t* site = GetCallSite(format, priority);
+    if (site != nullptr && site->count++ >= fRateLimitCount) {
+      va_copy(copy, args);
+      ForEachIntArg(format, copy, [&](int i, long val) {
+        if (i >= kMaxTrackedParams) return;
+        if (i >= site->n_params) site->n_params = i+1;
+        for (long cur = site->min[i]; val < cur && !site->min[i].compare_exchange_weak(cur, val);) {}
+        for (long cur = site->max[i]; val > cur && !site->max[i].compare_exchange_weak(cur, val);) {}
+      });
+      va_end(copy);
+      site->suppressed++;
+      fTotalSuppressed++;
+      return 0;
+    }
+  }
+
+  // Local and Debug messages aren't formatted here at all, we just copy the
+  // arguments and the writer thread does the rest. Everything else gets
+  // formatted into a per-thread buffer, so no allocations unless it's huge.
+  thread_local char buffer[1024];
+  const char* deferred = nullptr;
+  int len = -1;
+  if (priority <= Debug) {
+    va_copy(copy, args);
+    len = PackArgs(format, copy, buffer, kSlotBytes);
+    va_end(copy);
+    if (len >= 0) deferred = format;
+  }
+  if (deferred == nullptr) {
+    va_copy(copy, args);
+    len = std::vsnprintf(buffer, sizeof(buffer), format, copy);
+    va_end(copy);
+    if (len < 0) return -1;
+    if (len >= (int)sizeof(buffer)) {
+      std::string message(len, '\0');
+      va_copy(copy, args);
+      std::vsnprintf(&message[0], len+1, format, copy);
+      va_end(copy);
+      return Entry(priority, message);
     }
   }
+  if (!Push(priority, deferred, buffer, len)) {
+    fDropped++;
+    fTotalDropped++;
+    return -1;
+  }
   return 0;
 }
 
+int MongoLog::Entry(int priority, const std::string& message){
+  if (!Push(priority, nullptr, message.data(), message.size())) {
+    fDropped++;
+    fTotalDropped++;
+    return -1;
+  }
+  return 0;
+}
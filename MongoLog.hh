@@ -3,23 +3,16 @@
 
 #include <unistd.h>
 #include <sstream>
-#include <fstream>
-#include <iomanip>
 #include <cstdarg>
 #include <cstring>
-#include <mutex>
+#include <ctime>
 #include <string>
-#include <map>
 #include <vector>
 #include <atomic>
 #include <thread>
-#include <experimental/filesystem>
 #include <memory>
 
-#include <mongocxx/pool.hpp>
-#include <mongocxx/client.hpp>
-#include <mongocxx/database.hpp>
-#include <mongocxx/collection.hpp>
+#include "LogSink.hh"
 
 /* 
    A brief treatise on log priorities. 
@@ -52,11 +45,25 @@
 
 class MongoLog{
   /*
-    Logging class that writes to MongoDB
+    Logging class that (usually) writes to MongoDB. Entry() only formats the
+    message and pushes it into a bounded lock-free ring, a background thread
+    drains the ring and hands batches to the sinks (see LogSink.hh), which
+    do the (slow) file and database writes. If the
+    ring is full the message is dropped and counted rather than blocking
+    the caller.
+    Local and Debug messages are not even formatted by the caller: the format
+    pointer and a binary copy of the arguments go into the ring, and the
+    writer thread formats them later. That's why the format has to be a
+    string literal, anything else goes through Entry(priority, std::string).
+    Messages that can repeat thousands of times a second in a bad state go
+    through LimitedEntry instead, which is rate-limited per call site (ie,
+    per format string) below Error: the first N per period go out verbatim,
+    the rest are only counted and summarized once per period. Plain Entry
+    is never limited.
   */
 
 public:
-  MongoLog(int DeleteAfterDays, std::shared_ptr<mongocxx::pool>&, std::string, std::string, std::string);
+  MongoLog(std::vector<std::unique_ptr<LogSink>>&);
   ~MongoLog();
   
   int  Initialize(std::string connection_string,
@@ -70,32 +77,66 @@ public:
   const static int Fatal   = 4;  // Program gonna die
   const static int Local   = -1; // Write to local (file) log only
 
-  int Entry(int priority,std::string message, ...);
+  // The format has to be a string literal, it's used after the call
+  // returns. The Makefile makes anything else a compile error
+  // (-Werror=format-nonliteral) and the arguments are checked against it
+  int Entry(int priority, const char* format, ...) __attribute__((format(printf, 3, 4)));
+  int Entry(int priority, const std::string& message);
+  // Same, rate-limited per call site, the format's address
+  int LimitedEntry(int priority, const char* format, ...) __attribute__((format(printf, 3, 4)));
   void SetRunId(const int runid) {fRunId = runid;}
+  void SetRateLimit(int count, int period) {fRateLimitCount = count; fRateLimitPeriod = period;}
+  long GetDropped() {return fTotalDropped.load();}
+  long GetSuppressed() {return fTotalSuppressed.load();}
 
 private:
-  void Flusher();
-  std::string FormatTime(struct tm* date);
-  int Today(struct tm* date);
-  int RotateLogFile();
-  std::string LogFileName(struct tm* date);
-  std::shared_ptr<mongocxx::pool> fPool;
-  mongocxx::pool::entry fClient;
-  mongocxx::database fDB;
-  mongocxx::collection fCollection;
-  std::vector<std::string> fPriorities{"LOCAL", "DEBUG", "MESSAGE",
-      "WARNING", "ERROR", "FATAL"};
-  std::ofstream fOutfile;
-  std::string fHostname;
-  int fLogLevel;
-  int fDeleteAfterDays;
-  int fToday;
-  std::mutex fMutex;
-  std::experimental::filesystem::path fOutputDir;
-  std::thread fFlushThread;
-  std::atomic_bool fFlush;
+  static const std::size_t kSlotBytes = 432;
+  struct alignas(64) slot_t {
+    std::atomic<std::size_t> sequence;
+    int priority;
+    int runid;
+    std::time_t time;
+    const char* format; // if set, data holds its packed arguments
+    std::size_t length;
+    std::unique_ptr<std::string> overflow; // for messages longer than kSlotBytes
+    char data[kSlotBytes];
+  };
+  static const int kMaxTrackedParams = 4;
+  struct call_site_t {
+    std::atomic<const char*> format;
+    std::atomic_int priority;
+    std::atomic_long count, suppressed;
+    std::atomic_int n_params;
+    std::atomic_long min[kMaxTrackedParams], max[kMaxTrackedParams];
+  };
+  int VEntry(int, const char*, bool, va_list);
+  call_site_t* GetCallSite(const char*, int);
+  void ResetCallSite(call_site_t*);
+  void SummarizeSuppressed(std::vector<log_record>&, int);
+  void Start();
+  bool Push(int, const char*, const char*, std::size_t);
+  bool Pop(log_record&);
+  void Writer();
+  void WriteBatch(std::vector<log_record>&);
+  std::vector<std::unique_ptr<LogSink>> fSinks;
+  std::thread fWriteThread;
+  std::atomic_bool fRunning;
   int fFlushPeriod;
-  int fRunId;
+  std::atomic_int fRunId;
+
+  // MPSC ring, see http://www.1024cores.net/home/lock-free-algorithms/queues
+  std::unique_ptr<slot_t[]> fRing;
+  std::size_t fRingMask;
+  unsigned fBatchSize;
+  alignas(64) std::atomic<std::size_t> fEnqueuePos;
+  alignas(64) std::size_t fDequeuePos; // writer thread only
+  std::atomic_long fDropped, fTotalDropped;
+
+  // per-call-site rate limiting, open addressing keyed on the format pointer
+  std::unique_ptr<call_site_t[]> fCallSites;
+  std::size_t fCallSiteMask;
+  std::atomic_int fRateLimitCount, fRateLimitPeriod;
+  std::atomic_long fTotalSuppressed;
 };
 
 #endif
@@ -0,0 +1,40 @@
+#include "MongoSink.hh"
+#include "MongoLog.hh"
+#include <iostream>
+#include <bsoncxx/builder/stream/document.hpp>
+
+MongoSink::MongoSink(std::shared_ptr<mongocxx::pool>& pool, std::string dbname, std::string host) :
+  fPool(pool), fClient(pool->acquire()) {
+  fDB = (*fClient)[dbname];
+  fCollection = fDB["log"];
+  fHostname = host;
+  fLogLevel = 1; // Message
+}
+
+void MongoSink::Write(const std::vector<log_record>& batch) {
+  std::vector<bsoncxx::document::value> docs;
+  for (auto& rec : batch) {
+    if (rec.priority < fLogLevel) continue;
+    docs.emplace_back(bsoncxx::builder::stream::document{} <<
+      "user" << fHostname <<
+      "message" << rec.message <<
+      "priority" << rec.priority <<
+      "runid" << rec.runid <<
+      bsoncxx::builder::stream::finalize);
+  }
+  if (docs.size() == 0) return;
+  try{
+    fCollection.insert_many(docs);
+  }
+  catch(const std::exception &e){
+    std::cout<<"Failed to insert "<<docs.size()<<" log messages: "<<e.what()<<std::endl;
+  }
+}
+
+std::shared_ptr<MongoLog> MakeMongoLog(int DeleteAfterDays, std::shared_ptr<mongocxx::pool>& pool,
+    std::string dbname, std::string log_dir, std::string host) {
+  std::vector<std::unique_ptr<LogSink>> sinks;
+  sinks.emplace_back(std::make_unique<FileSink>(log_dir, host, DeleteAfterDays));
+  sinks.emplace_back(std::make_unique<MongoSink>(pool, dbname, host));
+  return std::make_shared<MongoLog>(sinks);
+}
@@ -0,0 +1,41 @@
+#ifndef _MONGOSINK_HH_
+#define _MONGOSINK_HH_
+
+#include <memory>
+#include <string>
+#include <vector>
+#include "LogSink.hh"
+
+#include <mongocxx/pool.hpp>
+#include <mongocxx/client.hpp>
+#include <mongocxx/database.hpp>
+#include <mongocxx/collection.hpp>
+
+class MongoLog;
+
+class MongoSink : public LogSink{
+  /*
+    Uploads everything with priority >= Message to the "log" collection.
+    The only sink that needs the database, so it's the only one that
+    pulls in mongocxx
+  */
+public:
+  MongoSink(std::shared_ptr<mongocxx::pool>&, std::string, std::string);
+  virtual ~MongoSink() {}
+
+  virtual void Write(const std::vector<log_record>&);
+
+private:
+  std::shared_ptr<mongocxx::pool> fPool;
+  mongocxx::pool::entry fClient;
+  mongocxx::database fDB;
+  mongocxx::collection fCollection;
+  std::string fHostname;
+  int fLogLevel;
+};
+
+// What the old MongoLog constructor did: daily files plus the database
+std::shared_ptr<MongoLog> MakeMongoLog(int DeleteAfterDays, std::shared_ptr<mongocxx::pool>&,
+    std::string dbname, std::string log_dir, std::string host);
+
+#endif // _MONGOSINK_HH_ defined
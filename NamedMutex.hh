@@ -0,0 +1,142 @@
+#ifndef _NAMEDMUTEX_HH_
+#define _NAMEDMUTEX_HH_
+
+#include <mutex>
+#include <condition_variable>
+#include <map>
+#include <string>
+
+struct lock_stats_t {
+  long acquisitions;
+  long contended;
+  double wait_us; // total
+  double max_hold_us;
+};
+
+#ifdef REDAX_LOCK_STATS
+
+#include <atomic>
+#include <chrono>
+#include <set>
+#include <algorithm>
+
+class NamedMutex{
+  /*
+    A std::mutex that counts how often it's taken, how often someone had to
+    wait for it and for how long, and the longest it was held. Instances
+    with the same name are added together. Only built with
+    -DREDAX_LOCK_STATS (make LOCK_STATS=1), otherwise NamedMutex is a plain
+    std::mutex.
+    The counters are only written by whoever holds the lock, so they don't
+    need atomic read-modify-writes.
+  */
+public:
+  explicit NamedMutex(const char* name) : fName(name) {
+    fAcquisitions = fContended = fWaitNs = fMaxHoldNs = 0;
+    fLockedAt = 0;
+    const std::lock_guard<std::mutex> lg(Registry().mutex);
+    Registry().live.insert(this);
+  }
+  ~NamedMutex() {
+    auto& r = Registry();
+    const std::lock_guard<std::mutex> lg(r.mutex);
+    r.live.erase(this);
+    AddTo(r.retired[fName]);
+  }
+  NamedMutex(const NamedMutex&) = delete;
+  NamedMutex& operator=(const NamedMutex&) = delete;
+
+  void lock() {
+    if (!fMutex.try_lock()) {
+      long start = Now();
+      fMutex.lock();
+      long now = Now();
+      Bump(fContended, 1);
+      Bump(fWaitNs, now - start);
+      Acquired(now);
+    } else {
+      Acquired(Now());
+    }
+  }
+  bool try_lock() {
+    if (!fMutex.try_lock()) return false;
+    Acquired(Now());
+    return true;
+  }
+  void unlock() {
+    long held = Now() - fLockedAt;
+    if (held > fMaxHoldNs.load(std::memory_order_relaxed))
+      fMaxHoldNs.store(held, std::memory_order_relaxed);
+    fMutex.unlock();
+  }
+
+  // name: stats, over everything since the last Reset
+  static std::map<std::string, lock_stats_t> Stats() {
+    auto& r = Registry();
+    const std::lock_guard<std::mutex> lg(r.mutex);
+    std::map<std::string, lock_stats_t> ret = r.retired;
+    for (auto m : r.live) m->AddTo(ret[m->fName]);
+    return ret;
+  }
+  static void ResetStats() {
+    auto& r = Registry();
+    const std::lock_guard<std::mutex> lg(r.mutex);
+    r.retired.clear();
+    for (auto m : r.live) {
+      m->fAcquisitions = m->fContended = m->fWaitNs = m->fMaxHoldNs = 0;
+    }
+  }
+
+private:
+  struct registry_t {
+    std::mutex mutex;
+    std::set<NamedMutex*> live;
+    std::map<std::string, lock_stats_t> retired;
+  };
+  static registry_t& Registry() {
+    static registry_t r;
+    return r;
+  }
+  static long Now() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+  }
+  static void Bump(std::atomic_long& counter, long value) {
+    counter.store(counter.load(std::memory_order_relaxed) + value, std::memory_order_relaxed);
+  }
+  void Acquired(long now) {
+    Bump(fAcquisitions, 1);
+    fLockedAt = now;
+  }
+  void AddTo(lock_stats_t& s) const {
+    s.acquisitions += fAcquisitions;
+    s.contended += fContended;
+    s.wait_us += fWaitNs/1e3;
+    s.max_hold_us = std::max<double>(s.max_hold_us, fMaxHoldNs/1e3);
+  }
+
+  std::mutex fMutex;
+  const char* fName;
+  std::atomic_long fAcquisitions, fContended, fWaitNs, fMaxHoldNs;
+  long fLockedAt;
+};
+
+// condition_variable only works with std::mutex
+using NamedCondVar = std::condition_variable_any;
+using NamedLock = std::unique_lock<NamedMutex>;
+
+#else
+
+class NamedMutex : public std::mutex {
+public:
+  explicit NamedMutex(const char*) {}
+  static std::map<std::string, lock_stats_t> Stats() {return {};}
+  static void ResetStats() {}
+};
+
+using NamedCondVar = std::condition_variable;
+using NamedLock = std::unique_lock<std::mutex>;
+
+#endif // REDAX_LOCK_STATS
+
+#endif // _NAMEDMUTEX_HH_ defined
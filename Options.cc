@@ -244,6 +244,22 @@ int16_t Options::GetChannel(int bid, int cid){
   }
 }
 
+std::map<int, std::vector<int16_t>> Options::GetChannelMap() {
+  // board -> global channel of each input
+  std::map<int, std::vector<int16_t>> ret;
+  try{
+    for (auto& board : bson_options["channels"].get_document().view()) {
+      auto& channels = ret[std::stoi(std::string(board.key()))];
+      for (auto& ch : board.get_array().value)
+        channels.push_back(ch.get_int32().value);
+    }
+  }
+  catch(std::exception& e){
+    fLog->Entry(MongoLog::Error, "Failed to load the channel map: %s", e.what());
+  }
+  return ret;
+}
+
 int Options::GetHEVOpt(HEVOptions &ret){
   try{
     ret.signal_threshold = bson_options["DDC10"]["signal_threshold"].get_int32().value;
@@ -330,3 +346,8 @@ void Options::UpdateDAC(std::map<int, std::vector<uint16_t>>& all_dacs){
   return;
 }
 
+
+void Options::SaveRunReport(bsoncxx::document::value& report) {
+  fDB["run_reports"].insert_one(report.view());
+  return;
+}
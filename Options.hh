@@ -85,11 +85,13 @@ public:
   int GetCrateOpt(CrateOptions &ret);
   int GetHEVOpt(HEVOptions &ret);
   int16_t GetChannel(int, int);
+  std::map<int, std::vector<int16_t>> GetChannelMap();
   int GetNestedInt(std::string, int);
   std::vector<uint16_t> GetThresholds(int);
   int GetFaxOptions(fax_options_t&);
 
   void UpdateDAC(std::map<int, std::vector<uint16_t>>&);
+  void SaveRunReport(bsoncxx::document::value&);
 
 private:
   int Load(std::string, mongocxx::collection*, std::string);
@@ -0,0 +1,62 @@
+#include "PerfCounters.hh"
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <cerrno>
+#include <cstring>
+
+PerfCounters::PerfCounters() {
+  fLeader = -1;
+  for (int i = 0; i < kNumCounters; i++) fFD[i] = -1;
+}
+
+PerfCounters::~PerfCounters() {
+  for (int i = 0; i < kNumCounters; i++) if (fFD[i] >= 0) close(fFD[i]);
+}
+
+int PerfCounters::Open(std::string& error) {
+  const uint64_t configs[kNumCounters] = {PERF_COUNT_HW_CPU_CYCLES,
+    PERF_COUNT_HW_INSTRUCTIONS, PERF_COUNT_HW_CACHE_MISSES, PERF_COUNT_HW_BRANCH_MISSES};
+  for (int i = 0; i < kNumCounters; i++) {
+    struct perf_event_attr attr;
+    std::memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = PERF_TYPE_HARDWARE;
+    attr.config = configs[i];
+    attr.disabled = (i == 0);
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    attr.read_format = PERF_FORMAT_GROUP | PERF_FORMAT_TOTAL_TIME_ENABLED |
+      PERF_FORMAT_TOTAL_TIME_RUNNING;
+    // this thread, any cpu
+    fFD[i] = syscall(__NR_perf_event_open, &attr, 0, -1, i == 0 ? -1 : fFD[0], 0);
+    if (fFD[i] < 0) {
+      error = std::strerror(errno);
+      for (int j = 0; j < i; j++) {
+        close(fFD[j]);
+        fFD[j] = -1;
+      }
+      return -1;
+    }
+  }
+  fLeader = fFD[0];
+  ioctl(fLeader, PERF_EVENT_IOC_RESET, PERF_IOC_FLAG_GROUP);
+  ioctl(fLeader, PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+  return 0;
+}
+
+perf_values_t PerfCounters::Read() {
+  perf_values_t ret{0, 0, 0, 0};
+  if (fLeader < 0) return ret;
+  // {nr, time_enabled, time_running, values[nr]}
+  uint64_t buf[3 + kNumCounters];
+  if (read(fLeader, buf, sizeof(buf)) != (ssize_t)sizeof(buf)) return ret;
+  // the PMU might be shared with others, in which case scale up
+  double scale = buf[2] > 0 && buf[2] < buf[1] ? double(buf[1])/buf[2] : 1.;
+  ret.cycles = buf[3]*scale;
+  ret.instructions = buf[4]*scale;
+  ret.cache_misses = buf[5]*scale;
+  ret.branch_misses = buf[6]*scale;
+  return ret;
+}
@@ -0,0 +1,48 @@
+#ifndef _PERFCOUNTERS_HH_
+#define _PERFCOUNTERS_HH_
+
+#include <cstdint>
+#include <string>
+
+struct perf_values_t {
+  uint64_t cycles;
+  uint64_t instructions;
+  uint64_t cache_misses;
+  uint64_t branch_misses;
+
+  perf_values_t& operator+=(const perf_values_t& rhs) {
+    cycles += rhs.cycles;
+    instructions += rhs.instructions;
+    cache_misses += rhs.cache_misses;
+    branch_misses += rhs.branch_misses;
+    return *this;
+  }
+  perf_values_t operator-(const perf_values_t& rhs) const {
+    return {cycles - rhs.cycles, instructions - rhs.instructions,
+      cache_misses - rhs.cache_misses, branch_misses - rhs.branch_misses};
+  }
+};
+
+class PerfCounters{
+  /*
+    Hardware counters (perf_event_open) for the thread that calls Open(),
+    as one group so they're always read together. Only counts user space,
+    so it works with perf_event_paranoid up to 2. If the kernel won't give
+    us the counters (higher paranoia, no PMU in a VM, seccomp) Open() says
+    why and Read() returns zeros.
+  */
+public:
+  PerfCounters();
+  ~PerfCounters();
+
+  int Open(std::string& error);
+  bool IsOpen() {return fLeader >= 0;}
+  perf_values_t Read();
+
+private:
+  static const int kNumCounters = 4;
+  int fLeader;
+  int fFD[kNumCounters];
+};
+
+#endif // _PERFCOUNTERS_HH_ defined
@@ -0,0 +1,185 @@
+#include "Profiler.hh"
+#include "MongoLog.hh"
+#include <execinfo.h>
+#include <dlfcn.h>
+#include <cxxabi.h>
+#include <sys/time.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <cerrno>
+#include <cstring>
+#include <fstream>
+#include <sstream>
+#include <algorithm>
+#include <chrono>
+
+std::atomic<Profiler*> Profiler::sActive{nullptr};
+
+Profiler::Profiler(std::shared_ptr<MongoLog>& log) : fLog(log) {
+  const std::size_t ring_size = 1 << 12; // must be a power of 2
+  fRing = std::make_unique<sample_t[]>(ring_size);
+  for (std::size_t i = 0; i < ring_size; i++) fRing[i].sequence.store(i, std::memory_order_relaxed);
+  fRingMask = ring_size - 1;
+  fEnqueuePos = 0;
+  fDequeuePos = 0;
+  fDropped = 0;
+  fRunning = false;
+}
+
+Profiler::~Profiler() {
+  if (fRunning) Stop("");
+}
+
+int Profiler::Start(int hz) {
+  Profiler* expected = nullptr;
+  if (fRunning || hz <= 0 || !sActive.compare_exchange_strong(expected, this)) return -1;
+  // backtrace() loads libgcc the first time, which isn't something to do in
+  // a signal handler
+  void* warmup[4];
+  backtrace(warmup, 4);
+
+  fStacks.clear();
+  fNames.clear();
+  fDropped = 0;
+  fRunning = true;
+  fAggregator = std::thread(&Profiler::Aggregate, this);
+
+  struct sigaction sa;
+  std::memset(&sa, 0, sizeof(sa));
+  sa.sa_sigaction = &Profiler::Handler;
+  sa.sa_flags = SA_SIGINFO | SA_RESTART;
+  sigemptyset(&sa.sa_mask);
+  sigaction(SIGPROF, &sa, &fOldAction);
+
+  struct itimerval timer;
+  timer.it_interval.tv_sec = 0;
+  timer.it_interval.tv_usec = std::max(1000000/hz, 1);
+  timer.it_value = timer.it_interval;
+  if (setitimer(ITIMER_PROF, &timer, nullptr)) {
+    fLog->Entry(MongoLog::Warning, "Can't start profiling timer: %s", std::strerror(errno));
+    sigaction(SIGPROF, &fOldAction, nullptr);
+    fRunning = false;
+    fAggregator.join();
+    sActive = nullptr;
+    return -1;
+  }
+  fLog->Entry(MongoLog::Local, "Profiler started at %i Hz", hz);
+  return 0;
+}
+
+long Profiler::Stop(const std::string& filename) {
+  if (!fRunning) return 0;
+  struct itimerval timer;
+  std::memset(&timer, 0, sizeof(timer));
+  setitimer(ITIMER_PROF, &timer, nullptr);
+  sActive = nullptr;
+  sigaction(SIGPROF, &fOldAction, nullptr);
+  fRunning = false;
+  if (fAggregator.joinable()) fAggregator.join();
+
+  long total = 0;
+  for (auto& p : fStacks) total += p.second;
+  if (filename != "") {
+    std::map<uintptr_t, std::string> symbols;
+    std::ofstream fout(filename);
+    for (auto& [stack, count] : fStacks) {
+      fout << fNames[stack[0]];
+      for (auto it = stack.rbegin(); it != stack.rend() - 1; it++) {
+        if (symbols.count(*it) == 0) symbols[*it] = Symbol(*it);
+        fout << ';' << symbols[*it];
+      }
+      fout << ' ' << count << '\n';
+    }
+  }
+  fLog->Entry(MongoLog::Local, "Profiler stopped with %li samples (%li dropped), %lu unique stacks",
+      total, fDropped.load(), fStacks.size());
+  return total;
+}
+
+void Profiler::Handler(int, siginfo_t*, void*) {
+  // Only async-signal-safe things in here
+  int saved_errno = errno;
+  Profiler* self = sActive.load(std::memory_order_acquire);
+  if (self != nullptr) {
+    sample_t* slot;
+    std::size_t pos = self->fEnqueuePos.load(std::memory_order_relaxed);
+    while (true) {
+      slot = &self->fRing[pos & self->fRingMask];
+      long diff = (long)slot->sequence.load(std::memory_order_acquire) - (long)pos;
+      if (diff == 0) {
+        if (self->fEnqueuePos.compare_exchange_weak(pos, pos+1, std::memory_order_relaxed))
+          break;
+      } else if (diff < 0) {
+        self->fDropped++;
+        slot = nullptr;
+        break;
+      } else {
+        pos = self->fEnqueuePos.load(std::memory_order_relaxed);
+      }
+    }
+    if (slot != nullptr) {
+      slot->tid = syscall(SYS_gettid);
+      slot->depth = backtrace(slot->pcs, kMaxDepth);
+      slot->sequence.store(pos+1, std::memory_order_release);
+    }
+  }
+  errno = saved_errno;
+}
+
+bool Profiler::Pop(std::vector<uintptr_t>& stack) {
+  sample_t* slot = &fRing[fDequeuePos & fRingMask];
+  std::size_t seq = slot->sequence.load(std::memory_order_acquire);
+  if ((long)seq - (long)(fDequeuePos+1) < 0) return false;
+  // the first two frames are the handler and the signal trampoline
+  stack.assign(1, slot->tid);
+  for (int i = 2; i < slot->depth; i++) stack.push_back((uintptr_t)slot->pcs[i]);
+  slot->sequence.store(fDequeuePos + fRingMask + 1, std::memory_order_release);
+  fDequeuePos++;
+  return true;
+}
+
+void Profiler::Aggregate() {
+  std::vector<uintptr_t> stack;
+  stack.reserve(kMaxDepth+1);
+  while (true) {
+    bool running = fRunning;
+    while (Pop(stack)) {
+      fStacks[stack]++;
+      // while the thread's still around to ask
+      if (fNames.count(stack[0]) == 0) fNames[stack[0]] = ThreadName(stack[0]);
+    }
+    if (!running) break;
+    std::this_thread::sleep_for(std::chrono::milliseconds(50));
+  }
+}
+
+std::string Profiler::Symbol(uintptr_t pc) {
+  Dl_info info;
+  std::stringstream ss;
+  // return addresses point after the call
+  if (dladdr((void*)(pc-1), &info) == 0) {
+    ss << "0x" << std::hex << pc;
+    return ss.str();
+  }
+  if (info.dli_sname != nullptr) {
+    int status = 0;
+    char* demangled = abi::__cxa_demangle(info.dli_sname, nullptr, nullptr, &status);
+    std::string ret = status == 0 && demangled != nullptr ? demangled : info.dli_sname;
+    free(demangled);
+    // ';' separates frames and ' ' the count
+    std::replace(ret.begin(), ret.end(), ';', ':');
+    std::replace(ret.begin(), ret.end(), ' ', '_');
+    return ret;
+  }
+  std::string lib(info.dli_fname != nullptr ? info.dli_fname : "?");
+  ss << lib.substr(lib.find_last_of('/')+1) << "+0x" << std::hex << pc - (uintptr_t)info.dli_fbase;
+  return ss.str();
+}
+
+std::string Profiler::ThreadName(int tid) {
+  std::ifstream fin("/proc/self/task/" + std::to_string(tid) + "/comm");
+  std::string name;
+  if (!std::getline(fin, name) || name == "") name = "thread";
+  std::replace(name.begin(), name.end(), ' ', '_');
+  return name + "-" + std::to_string(tid);
+}
@@ -0,0 +1,62 @@
+#ifndef _PROFILER_HH_
+#define _PROFILER_HH_
+
+#include <atomic>
+#include <map>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+#include <csignal>
+
+class MongoLog;
+
+class Profiler{
+  /*
+    Poor man's perf: SIGPROF at a fixed rate of process CPU time, the
+    interrupted thread grabs its own stack in the handler and puts it in a
+    lock-free ring, and a helper thread folds the stacks together. Stop()
+    writes them out in the "folded" format that flamegraph.pl and
+    speedscope read: "thread;outer;...;inner count" per line.
+    There is only one SIGPROF, so only one Profiler can run at a time.
+    Function names need the binary linked with -rdynamic.
+  */
+public:
+  Profiler(std::shared_ptr<MongoLog>&);
+  ~Profiler();
+
+  int Start(int hz);
+  long Stop(const std::string& filename);
+  bool Running() {return fRunning;}
+
+private:
+  static const int kMaxDepth = 48;
+  struct sample_t {
+    std::atomic<std::size_t> sequence;
+    int tid;
+    int depth;
+    void* pcs[kMaxDepth];
+  };
+
+  static void Handler(int, siginfo_t*, void*);
+  bool Pop(std::vector<uintptr_t>&);
+  void Aggregate();
+  std::string Symbol(uintptr_t);
+  std::string ThreadName(int tid);
+
+  static std::atomic<Profiler*> sActive;
+
+  std::shared_ptr<MongoLog> fLog;
+  std::unique_ptr<sample_t[]> fRing;
+  std::size_t fRingMask;
+  alignas(64) std::atomic<std::size_t> fEnqueuePos;
+  alignas(64) std::size_t fDequeuePos;
+  std::atomic_long fDropped;
+  std::atomic_bool fRunning;
+  std::thread fAggregator;
+  struct sigaction fOldAction;
+  std::map<std::vector<uintptr_t>, long> fStacks; // {tid, inner pc, ..., outer pc}
+  std::map<uintptr_t, std::string> fNames; // tid
+};
+
+#endif // _PROFILER_HH_ defined
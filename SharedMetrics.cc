@@ -0,0 +1,78 @@
+#include "SharedMetrics.hh"
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <cerrno>
+#include <cstring>
+#include <new>
+
+SharedMetrics::SharedMetrics(const std::string& host, bool writer) :
+    fSegment(nullptr), fName(SegmentName(host)), fWriter(writer) {
+  int fd = writer ? shm_open(fName.c_str(), O_CREAT | O_RDWR, 0644) :
+    shm_open(fName.c_str(), O_RDONLY, 0);
+  if (fd < 0) {
+    fError = fName + ": " + std::strerror(errno);
+    return;
+  }
+  struct stat st;
+  if (writer && ftruncate(fd, sizeof(metrics_segment_t))) {
+    fError = std::string("ftruncate: ") + std::strerror(errno);
+  } else if (!writer && (fstat(fd, &st) || st.st_size < (off_t)sizeof(metrics_segment_t))) {
+    fError = fName + " is too small, is it from a different version?";
+  } else {
+    void* p = mmap(nullptr, sizeof(metrics_segment_t), writer ? PROT_READ | PROT_WRITE : PROT_READ,
+        MAP_SHARED, fd, 0);
+    if (p == MAP_FAILED)
+      fError = std::string("mmap: ") + std::strerror(errno);
+    else
+      fSegment = static_cast<metrics_segment_t*>(p);
+  }
+  close(fd);
+  if (fSegment == nullptr) {
+    if (writer) shm_unlink(fName.c_str());
+    return;
+  }
+  if (writer) {
+    std::memset((void*)fSegment, 0, sizeof(metrics_segment_t));
+    new (&fSegment->sequence) std::atomic<uint64_t>(0);
+    fSegment->size = sizeof(metrics_segment_t);
+    fSegment->version = kMetricsVersion;
+    fSegment->pid = getpid();
+    std::atomic_thread_fence(std::memory_order_release);
+    fSegment->magic = kMetricsMagic;
+  } else if (fSegment->magic != kMetricsMagic || fSegment->version != kMetricsVersion ||
+      fSegment->size != sizeof(metrics_segment_t)) {
+    fError = fName + " has version " + std::to_string(fSegment->version) + ", expected " +
+      std::to_string(kMetricsVersion);
+    munmap(fSegment, sizeof(metrics_segment_t));
+    fSegment = nullptr;
+  }
+}
+
+SharedMetrics::~SharedMetrics() {
+  if (fSegment == nullptr) return;
+  munmap(fSegment, sizeof(metrics_segment_t));
+  if (fWriter) shm_unlink(fName.c_str());
+}
+
+void SharedMetrics::Publish(const metrics_t& data) {
+  if (fSegment == nullptr || !fWriter) return;
+  uint64_t seq = fSegment->sequence.load(std::memory_order_relaxed);
+  fSegment->sequence.store(seq+1, std::memory_order_relaxed);
+  std::atomic_thread_fence(std::memory_order_release);
+  std::memcpy(&fSegment->data, &data, sizeof(data));
+  fSegment->sequence.store(seq+2, std::memory_order_release);
+}
+
+bool SharedMetrics::Read(metrics_t& data) {
+  if (fSegment == nullptr) return false;
+  for (int attempt = 0; attempt < 100; attempt++) {
+    uint64_t before = fSegment->sequence.load(std::memory_order_acquire);
+    if (before & 1) continue;
+    std::memcpy(&data, &fSegment->data, sizeof(data));
+    std::atomic_thread_fence(std::memory_order_acquire);
+    if (fSegment->sequence.load(std::memory_order_relaxed) == before) return true;
+  }
+  return false;
+}
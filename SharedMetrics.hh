@@ -0,0 +1,89 @@
+#ifndef _SHAREDMETRICS_HH_
+#define _SHAREDMETRICS_HH_
+
+#include <atomic>
+#include <cstdint>
+#include <string>
+
+// Layout of the shared-memory segment. Bump kMetricsVersion whenever any of
+// these structs change, readers refuse segments with a different version.
+const uint32_t kMetricsMagic = 0x58444552; // "REDX"
+const uint32_t kMetricsVersion = 3;
+const int kMetricsMaxLinks = 16;
+const int kMetricsMaxFormatters = 64;
+const int kMetricsMaxBoards = 64;
+
+// Counters are totals since the process started (or the run was armed),
+// the reader works out the rates
+struct metrics_link_t {
+  int32_t link;
+  int32_t boards;
+  int64_t bytes;
+  int32_t throttled; // paused for the memory budget right now
+  int32_t throttle_events;
+  int64_t throttle_ns;
+};
+
+struct metrics_formatter_t {
+  int64_t input_bytes; // queued for processing
+  int64_t output_bytes; // processed, waiting to be compressed and written
+  int64_t spill_bytes; // input waiting on disk
+  int64_t cpu_ns;
+};
+
+struct metrics_board_t {
+  int32_t bid;
+  int32_t link;
+  int64_t reads; // that returned data
+  int64_t blts;
+  int64_t bytes;
+};
+
+struct metrics_t {
+  int64_t time_ns; // unix time of the update
+  int32_t status;
+  int32_t run;
+  int32_t n_links, n_formatters, n_boards;
+  int64_t log_dropped, log_suppressed;
+  metrics_link_t links[kMetricsMaxLinks];
+  metrics_formatter_t formatters[kMetricsMaxFormatters];
+  metrics_board_t boards[kMetricsMaxBoards];
+};
+
+struct metrics_segment_t {
+  uint32_t magic;
+  uint32_t version;
+  uint32_t size; // sizeof(metrics_segment_t)
+  int32_t pid;
+  std::atomic<uint64_t> sequence; // odd while an update is in progress
+  metrics_t data;
+};
+
+class SharedMetrics{
+  /*
+    Live counters in POSIX shared memory (/dev/shm/redax_<host>) so
+    redax-top can watch a reader without going through the database.
+    One writer (the status thread) and any number of readers, kept
+    consistent with a seqlock: the writer never waits, readers retry if
+    they caught an update halfway.
+  */
+public:
+  // Writer creates the segment (and removes it again), readers just map it
+  SharedMetrics(const std::string& host, bool writer);
+  ~SharedMetrics();
+
+  bool IsOpen() {return fSegment != nullptr;}
+  std::string Error() {return fError;}
+  void Publish(const metrics_t&);
+  bool Read(metrics_t&);
+  int Pid() {return fSegment != nullptr ? fSegment->pid : 0;}
+
+  static std::string SegmentName(const std::string& host) {return "/redax_" + host;}
+
+private:
+  metrics_segment_t* fSegment;
+  std::string fName, fError;
+  bool fWriter;
+};
+
+#endif // _SHAREDMETRICS_HH_ defined
@@ -0,0 +1,101 @@
+#include "SpillQueue.hh"
+#include "StraxFormatter.hh"
+#include "V1724.hh"
+#include <sys/uio.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <cerrno>
+#include <cstring>
+#include <vector>
+
+SpillQueue::SpillQueue() {
+  fFD = -1;
+  fWritePos = fReadPos = 0;
+}
+
+SpillQueue::~SpillQueue() {
+  if (fFD >= 0) close(fFD);
+}
+
+int SpillQueue::Open(const std::string& directory, std::string& error) {
+#ifdef O_TMPFILE
+  fFD = open(directory.c_str(), O_TMPFILE | O_RDWR | O_CLOEXEC, 0600);
+#endif
+  if (fFD < 0) {
+    // not every filesystem does O_TMPFILE
+    std::string name = directory + "/redax_spill_XXXXXX";
+    std::vector<char> tmpl(name.begin(), name.end());
+    tmpl.push_back('\0');
+    fFD = mkstemp(tmpl.data());
+    if (fFD >= 0) unlink(tmpl.data());
+  }
+  if (fFD < 0) {
+    error = directory + ": " + std::strerror(errno);
+    return -1;
+  }
+  return 0;
+}
+
+long SpillQueue::Push(const data_packet& dp) {
+  record_t rec{dp.digi->bid(), dp.header_time, dp.clock_counter, dp.read_time,
+    dp.watermark, (int64_t)dp.buff.size()};
+  {
+    const std::lock_guard<std::mutex> lg(fMutex);
+    if (fBoards.count(rec.bid) == 0) fBoards[rec.bid] = dp.digi;
+  }
+  const std::lock_guard<std::mutex> lg(fWriteMutex);
+  struct iovec iov[2] = {{&rec, sizeof(rec)},
+    {(void*)dp.buff.data(), dp.buff.size()*sizeof(char32_t)}};
+  long total = iov[0].iov_len + iov[1].iov_len, written = 0, pos = fWritePos.load();
+  while (written < total) {
+    ssize_t n = pwritev(fFD, iov, 2, pos + written);
+    if (n <= 0) {
+      if (n < 0 && errno == EINTR) continue;
+      return -1;
+    }
+    written += n;
+    // skip over what's done
+    for (auto& v : iov) {
+      std::size_t skip = std::min<std::size_t>(n, v.iov_len);
+      v.iov_base = (char*)v.iov_base + skip;
+      v.iov_len -= skip;
+      n -= skip;
+    }
+  }
+  fWritePos.store(pos + total, std::memory_order_release);
+  return total;
+}
+
+int SpillQueue::Pop(std::unique_ptr<data_packet>& dp) {
+  long pos = fReadPos.load();
+  if (pos >= fWritePos.load(std::memory_order_acquire)) return 0;
+  record_t rec;
+  auto read_all = [&](void* dest, long bytes, long offset) {
+    for (long done = 0; done < bytes;) {
+      ssize_t n = pread(fFD, (char*)dest + done, bytes - done, offset + done);
+      if (n < 0 && errno == EINTR) continue;
+      if (n <= 0) return false;
+      done += n;
+    }
+    return true;
+  };
+  if (!read_all(&rec, sizeof(rec), pos)) return -1;
+  dp = std::make_unique<data_packet>();
+  dp->buff.resize(rec.words);
+  if (!read_all(dp->buff.data(), rec.words*sizeof(char32_t), pos + sizeof(rec))) return -1;
+  dp->header_time = rec.header_time;
+  dp->clock_counter = rec.clock_counter;
+  dp->read_time = rec.read_time;
+  dp->watermark = rec.watermark;
+  {
+    const std::lock_guard<std::mutex> lg(fMutex);
+    dp->digi = fBoards[rec.bid];
+  }
+  fReadPos = pos + sizeof(rec) + rec.words*sizeof(char32_t);
+  return 1;
+}
+
+void SpillQueue::Reset() {
+  // give the space back
+  if (ftruncate(fFD, 0) == 0) fWritePos = fReadPos = 0;
+}
@@ -0,0 +1,53 @@
+#ifndef _SPILLQUEUE_HH_
+#define _SPILLQUEUE_HH_
+
+#include <atomic>
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+
+struct data_packet;
+class V1724;
+
+class SpillQueue{
+  /*
+    FIFO of data_packets in a scratch file, for when a formatter falls too
+    far behind to keep its backlog in memory. Packets are appended with one
+    sequential write each and read back in the same order. The file has no
+    name (O_TMPFILE, or unlinked right after creation) so nothing is left
+    behind if we crash, and it's emptied again once fully read.
+    Any number of threads may Push (one write at a time, the caller orders
+    them), only one may Pop and Reset.
+  */
+public:
+  SpillQueue();
+  ~SpillQueue();
+
+  int Open(const std::string& directory, std::string& error);
+  bool IsOpen() {return fFD >= 0;}
+  long Push(const data_packet&); // bytes written, -1 on error
+  int Pop(std::unique_ptr<data_packet>&); // 1 for a packet, 0 if empty, -1 on error
+  bool Empty() {return fReadPos.load() >= fWritePos.load(std::memory_order_acquire);}
+  long Bytes() {return fWritePos.load() - fReadPos.load();} // not read back yet
+  void Discard() {fReadPos = fWritePos.load();}
+  void Reset(); // only when Empty() and nobody is pushing
+
+private:
+  struct record_t {
+    int32_t bid;
+    uint32_t header_time;
+    int64_t clock_counter;
+    int64_t read_time;
+    int64_t watermark;
+    int64_t words;
+  };
+
+  int fFD;
+  std::atomic_long fWritePos, fReadPos;
+  std::mutex fMutex, fWriteMutex;
+  std::map<int, std::shared_ptr<V1724>> fBoards; // to put back into the packets
+};
+
+#endif // _SPILLQUEUE_HH_ defined
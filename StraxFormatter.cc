@@ -3,37 +3,83 @@
 #include "MongoLog.hh"
 #include "Options.hh"
 #include "V1724.hh"
+#include "XXHash.hh"
 #include <lz4frame.h>
 #include <blosc.h>
 #include <thread>
+#include <pthread.h>
 #include <sstream>
 #include <bitset>
 #include <ctime>
 #include <cmath>
+#include <cstring>
+#include <limits>
+#include <climits>
+#include <set>
 
 namespace fs=std::experimental::filesystem;
 using namespace std::chrono;
 const int event_header_words = 4, max_channels = 16;
+const unsigned max_trace_events = 1 << 18; // per thread
 
-double timespec_subtract(struct timespec& a, struct timespec& b) {
-  return (a.tv_sec - b.tv_sec)*1e6 + (a.tv_nsec - b.tv_nsec)/1e3;
+uint64_t ThreadCPUTime() { // ns
+  struct timespec ts;
+  clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+  return ts.tv_sec*1000000000ul + ts.tv_nsec;
 }
 
-StraxFormatter::StraxFormatter(std::shared_ptr<Options>& opts, std::shared_ptr<MongoLog>& log){
+int HistOption(std::shared_ptr<Options>& opts, const std::string& hist, const std::string& what, int def) {
+  return opts->GetInt("strax_hist_" + hist + "_" + what, def);
+}
+
+StraxFormatter::StraxFormatter(std::shared_ptr<Options>& opts, std::shared_ptr<MongoLog>& log) :
+    fBufferCounter(Histogram::Linear, HistOption(opts, "packets_per_transfer", "bins", 64),
+        HistOption(opts, "packets_per_transfer", "low", 0), HistOption(opts, "packets_per_transfer", "width", 1)),
+    fFragsPerEvent(Histogram::Log2, HistOption(opts, "fragments_per_event", "bins", 20)),
+    fEvPerDP(Histogram::Log2, HistOption(opts, "events_per_packet", "bins", 20)),
+    fBytesPerChunk(Histogram::Log2, HistOption(opts, "bytes_per_chunk", "bins", 40)),
+    fLatencyQueue(Histogram::Log2Fine, 304),
+    fLatencyProcess(Histogram::Log2Fine, 304),
+    fLatencySeal(Histogram::Log2Fine, 304),
+    fLatencyWrite(Histogram::Log2Fine, 304) {
   fActive = true;
+  fDrain = false;
   fChunkNameLength=6;
   fStraxHeaderSize=24;
   fBytesProcessed = 0;
+  fBytesUncompressed = fBytesCompressed = fFragments = 0;
+  fMaxInputBufferSize = 0;
   fInputBufferSize = 0;
   fOutputBufferSize = 0;
   fProcTimeDP = fProcTimeEv = fProcTimeCh = fCompTime = 0.;
   fOptions = opts;
+  std::string instrumentation = fOptions->GetString("instrumentation", "sampled");
+  if (instrumentation == "off") fInstrumentation = kOff;
+  else if (instrumentation == "full") fInstrumentation = kFull;
+  else fInstrumentation = kSampled;
+  fSampleEvery = std::max(1, fOptions->GetInt("instrumentation_sample_every", 64));
+  fEventCounter = 0;
+  fUsePerfCounters = fOptions->GetInt("perf_counters", 0) != 0;
+  fPerfDP = fPerfComp = {0, 0, 0, 0};
+  fCurrentReadTime = 0;
+  fLastChunk = -1;
+  fTraceEvery = fOptions->GetInt("latency_trace_every", 0);
+  fPacketCounter = 0;
   fChunkLength = long(fOptions->GetDouble("strax_chunk_length", 5)*1e9); // default 5s
   fChunkOverlap = long(fOptions->GetDouble("strax_chunk_overlap", 0.5)*1e9); // default 0.5s
   fFragmentBytes = fOptions->GetInt("strax_fragment_payload_bytes", 110*2);
   fFullFragmentSize = fFragmentBytes + fStraxHeaderSize;
   fCompressor = fOptions->GetString("compressor", "lz4");
+  fWriteMetadata = fOptions->GetInt("strax_chunk_metadata", 1) != 0;
+  fUseUring = fOptions->GetString("strax_io", "buffered") == "uring";
+  fUringDepth = fOptions->GetInt("strax_io_depth", 64);
+  fWriteBytes = 0;
+  fWriteTime = 0.;
   fFullChunkLength = fChunkLength+fChunkOverlap;
+  fSchedule = std::make_shared<ChunkSchedule>(fFullChunkLength);
+  fUnscheduledKnown = 0;
+  fUnscheduledSince = 0;
+  fScheduleTimeout = long(fOptions->GetDouble("strax_chunk_schedule_timeout", 30)*1e9);
   fHostname = fOptions->Hostname();
   std::string run_name;
   const int run_name_length = 6;
@@ -46,9 +92,37 @@ StraxFormatter::StraxFormatter(std::shared_ptr<Options>& opts, std::shared_ptr<M
   }
 
   fEmptyVerified = 0;
+  fFileWriter = std::make_shared<FileWriter>(log);
+  fLateFlushed = 0;
+  fLateFragments = 0;
+  fLateFiles = 0;
+  fFailedWrites = 0;
   fLog = log;
 
+  fChannelMap = fOptions->GetChannelMap();
+  fNumChannels = 0;
+  for (auto& board : fChannelMap)
+    for (auto ch : board.second) fNumChannels = std::max<int>(fNumChannels, ch+1);
+  fDataPerChan = std::make_unique<channel_counters_t[]>(
+      (fNumChannels + kCountersPerLine - 1)/kCountersPerLine);
+
+  fSpilling = fSpillFailed = false;
+  fSpillPushing = 0;
+  fSpillEvents = 0;
+  fBytesSpilled = fMaxSpill = 0;
+  fSpillThreshold = fOptions->GetInt("spill_threshold", 500)*1000000l;
+  if (std::string dir = fOptions->GetString("spill_directory", ""); dir != "") {
+    std::string error;
+    if (fSpill.Open(dir, error))
+      fLog->Entry(MongoLog::Warning, "Can't spill to disk, keeping everything in memory: %s",
+          error.c_str());
+  }
+
   fBufferNumChunks = fOptions->GetInt("strax_buffer_num_chunks", 2);
+  fSealByWatermark = fOptions->GetString("strax_chunk_sealing", "watermark") == "watermark";
+  fWatermark = nullptr;
+  fQueuedWatermark = 0;
+  fMaxEmptyPerCall = std::max(1, fOptions->GetInt("strax_max_empty_chunks", 100));
   fWarnIfChunkOlderThan = fOptions->GetInt("strax_chunk_phase_limit", 2);
 
   std::string output_path = fOptions->GetString("strax_output_path", "./");
@@ -65,21 +139,6 @@ StraxFormatter::StraxFormatter(std::shared_ptr<Options>& opts, std::shared_ptr<M
 }
 
 StraxFormatter::~StraxFormatter(){
-  std::stringstream ss;
-  ss << std::hex << fThreadId;
-  std::map<std::string, double> times {
-    {"data_packets_us", fProcTimeDP},
-    {"events_us", fProcTimeEv},
-    {"fragments_us", fProcTimeCh},
-    {"compression_us", fCompTime}
-  };
-  std::map<std::string, std::map<int, long>> counters {
-    {"fragments", fFragsPerEvent},
-    {"events", fEvPerDP},
-    {"data_packets", fBufferCounter},
-    {"chunks", fBytesPerChunk}
-  };
-  //fOptions->SaveBenchmarks(counters, fBytesProcessed, ss.str(), times);
 }
 
 void StraxFormatter::Close(std::map<int,int>& ret){
@@ -90,14 +149,58 @@ void StraxFormatter::Close(std::map<int,int>& ret){
 
 void StraxFormatter::GetDataPerChan(std::map<int, int>& ret) {
   if (!fActive) return;
-  const std::lock_guard<std::mutex> lk(fDPC_mutex);
-  for (auto& pair : fDataPerChan) {
-    ret[pair.first] += pair.second;
-    pair.second = 0;
+  for (int ch = 0; ch < fNumChannels; ch++) {
+    long bytes = fDataPerChan[ch/kCountersPerLine].bytes[ch%kCountersPerLine].exchange(0,
+        std::memory_order_relaxed);
+    if (bytes != 0) ret[ch] += bytes;
   }
   return;
 }
 
+std::map<std::string, const Histogram*> StraxFormatter::GetHistograms() {
+  return {
+    {"packets_per_transfer", &fBufferCounter},
+    {"fragments_per_event", &fFragsPerEvent},
+    {"events_per_packet", &fEvPerDP},
+    {"bytes_per_chunk", &fBytesPerChunk}
+  };
+}
+
+formatter_stats_t StraxFormatter::GetRunStats() {
+  // only meaningful once the thread is done
+  formatter_stats_t ret;
+  ret.thread = fFullHostname;
+  ret.data_packets_us = fProcTimeDP;
+  ret.events_us = fProcTimeEv;
+  ret.fragments_us = fProcTimeCh;
+  ret.compression_us = fCompTime;
+  ret.bytes_in = fBytesProcessed;
+  ret.bytes_uncompressed = fBytesUncompressed;
+  ret.bytes_compressed = fBytesCompressed;
+  ret.fragments = fFragments;
+  ret.max_input_buffer = fMaxInputBufferSize;
+  ret.spill_events = fSpillEvents;
+  ret.bytes_spilled = fBytesSpilled;
+  ret.max_spill = fMaxSpill;
+  ret.late_fragments = fLateFragments;
+  ret.late_files = fLateFiles;
+  ret.failed_writes = fFailedWrites;
+  ret.write_bytes = fWriteBytes;
+  ret.write_us = fWriteTime;
+  ret.perf_data_packets = fPerfDP;
+  ret.perf_compression = fPerfComp;
+  return ret;
+}
+
+std::map<std::string, const Histogram*> StraxFormatter::GetLatencies() {
+  return {
+    {"queue", &fLatencyQueue},
+    {"process", &fLatencyProcess},
+    {"seal", &fLatencySeal},
+    {"write", &fLatencyWrite}
+  };
+}
+
 void StraxFormatter::GenerateArtificialDeadtime(int64_t timestamp, const std::shared_ptr<V1724>& digi) {
   std::string fragment;
   fragment.reserve(fFullFragmentSize);
@@ -117,51 +220,69 @@ void StraxFormatter::GenerateArtificialDeadtime(int64_t timestamp, const std::sh
   return;
 }
 
+uint64_t StraxFormatter::Stamp() {
+  // thread CPU time in both modes, so sampled and full numbers compare
+  return ThreadCPUTime();
+}
+
+double StraxFormatter::Elapsed(uint64_t start) {
+  // us, scaled up to stand in for the events we didn't time
+  return (ThreadCPUTime() - start)/1e3*(fInstrumentation == kSampled ? fSampleEvery : 1);
+}
+
 void StraxFormatter::ProcessDatapacket(std::unique_ptr<data_packet> dp){
   // Take a buffer and break it up into one document per channel
-  struct timespec dp_start, dp_end, ev_start, ev_end;
+  uint64_t dp_start(0), ev_start(0);
   auto it = dp->buff.begin();
   int evs_this_dp(0), words(0);
-  bool missed = false;
-  std::map<int, int> dpc;
-  clock_gettime(CLOCK_THREAD_CPUTIME_ID, &dp_start);
+  bool missed = false, timed = false;
+  int64_t dequeued = SteadyNs();
+  fLatencyQueue.Fill((dequeued - dp->read_time)/1000);
+  perf_values_t perf_start = fPerf.Read();
+  fCurrentReadTime = dp->read_time;
+  fQueuedWatermark = std::max(fQueuedWatermark, dp->watermark);
+  fLastChunk = -1;
+  if (fInstrumentation != kOff) dp_start = ThreadCPUTime();
   do {
     if((*it)>>28 == 0xA){
       missed = true; // it works out
-      clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ev_start);
+      timed = fInstrumentation == kFull ||
+        (fInstrumentation == kSampled && fEventCounter++ % fSampleEvery == 0);
+      if (timed) ev_start = Stamp();
       words = (*it)&0xFFFFFFF;
       std::u32string_view sv(dp->buff.data() + std::distance(dp->buff.begin(), it), words);
       // std::u32string_view sv(it, it+words); //c++20 :(
-      ProcessEvent(sv, dp, dpc);
-      clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ev_end);
-      fProcTimeEv += timespec_subtract(ev_end, ev_start);
+      ProcessEvent(sv, dp, timed);
+      if (timed) fProcTimeEv += Elapsed(ev_start);
       evs_this_dp++;
       it += words;
     } else {
       if (missed) {
-        fLog->Entry(MongoLog::Warning, "Missed an event from %i at idx %x/%x (%x)",
+        fLog->LimitedEntry(MongoLog::Warning, "Missed an event from %i at idx %lx/%lx (%x)",
             dp->digi->bid(), std::distance(dp->buff.begin(), it), dp->buff.size(), *it);
         missed = false;
       }
       it++;
     }
   } while (it < dp->buff.end() && fActive == true);
-  clock_gettime(CLOCK_THREAD_CPUTIME_ID, &dp_end);
-  fProcTimeDP += timespec_subtract(dp_end, dp_start);
+  if (fInstrumentation != kOff) fProcTimeDP += (ThreadCPUTime() - dp_start)/1e3;
   fBytesProcessed += dp->buff.size()*sizeof(char32_t);
-  fEvPerDP[evs_this_dp]++;
-  {
-    const std::lock_guard<std::mutex> lk(fDPC_mutex);
-    for (auto& p : dpc) fDataPerChan[p.first] += p.second;
+  fEvPerDP.Fill(evs_this_dp);
+  if (fPerf.IsOpen()) fPerfDP += fPerf.Read() - perf_start;
+  int64_t processed = SteadyNs();
+  fLatencyProcess.Fill((processed - dp->read_time)/1000);
+  if (fTraceEvery > 0 && fPacketCounter++ % fTraceEvery == 0 && fTrace.size() < max_trace_events) {
+    fTrace.push_back({"queue", "board", dp->read_time, dequeued - dp->read_time, dp->digi->bid()});
+    fTrace.push_back({"process", "board", dequeued, processed - dequeued, dp->digi->bid()});
   }
   fInputBufferSize -= dp->buff.size()*sizeof(char32_t);
 }
 
 int StraxFormatter::ProcessEvent(std::u32string_view buff,
-    const std::unique_ptr<data_packet>& dp, std::map<int, int>& dpc) {
+    const std::unique_ptr<data_packet>& dp, bool timed) {
   // buff = start of event
 
-  struct timespec ch_start, ch_end;
+  uint64_t ch_start(0);
 
   // returns {words this event, channel mask, board fail, header timestamp}
   auto [words, channel_mask, fail, event_time] = dp->digi->UnpackEventHeader(buff);
@@ -180,20 +301,19 @@ int StraxFormatter::ProcessEvent(std::u32string_view buff,
 
   for(unsigned ch=0; ch<n_chan; ch++){
     if (channel_mask & (1<<ch)) {
-      clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ch_start);
-      ret = ProcessChannel(buff, words, channel_mask, event_time, frags, ch, dp, dpc);
-      clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ch_end);
-      fProcTimeCh += timespec_subtract(ch_end, ch_start);
+      if (timed) ch_start = Stamp();
+      ret = ProcessChannel(buff, words, channel_mask, event_time, frags, ch, dp);
+      if (timed) fProcTimeCh += Elapsed(ch_start);
       buff.remove_prefix(ret);
     }
   }
-  fFragsPerEvent[frags]++;
+  fFragsPerEvent.Fill(frags);
   return words;
 }
 
 int StraxFormatter::ProcessChannel(std::u32string_view buff, int words_in_event,
     int channel_mask, uint32_t event_time, int& frags, int channel,
-    const std::unique_ptr<data_packet>& dp, std::map<int, int>& dpc) {
+    const std::unique_ptr<data_packet>& dp) {
   // buff points to the first word of the channel's data
 
   int n_channels = std::bitset<max_channels>(channel_mask).count();
@@ -204,7 +324,10 @@ int StraxFormatter::ProcessChannel(std::u32string_view buff, int words_in_event,
   uint32_t samples_in_pulse = wf.size()*sizeof(char32_t)/sizeof(uint16_t);
   uint16_t sw = dp->digi->SampleWidth();
   int samples_per_frag= fFragmentBytes>>1;
-  int16_t global_ch = fOptions->GetChannel(dp->digi->bid(), channel);
+  int16_t global_ch = -1;
+  auto board = fChannelMap.find(dp->digi->bid());
+  if (board != fChannelMap.end() && channel < (int)board->second.size())
+    global_ch = board->second[channel];
   // Failing to discern which channel we're getting data from seems serious enough to throw
   if(global_ch==-1)
     throw std::runtime_error("Failed to parse channel map. I'm gonna just kms now.");
@@ -240,15 +363,33 @@ int StraxFormatter::ProcessChannel(std::u32string_view buff, int words_in_event,
 
     AddFragmentToBuffer(std::move(fragment), event_time, dp->clock_counter);
   } // loop over frag_i
-  dpc[global_ch] += samples_in_pulse*sizeof(uint16_t);
+  if (global_ch < fNumChannels)
+    fDataPerChan[global_ch/kCountersPerLine].bytes[global_ch%kCountersPerLine].fetch_add(
+        samples_in_pulse*sizeof(uint16_t), std::memory_order_relaxed);
   return channel_words;
 }
 
 void StraxFormatter::AddFragmentToBuffer(std::string fragment, uint32_t ts, int rollovers) {
   // Get the CHUNK and decide if this event also goes into a PRE/POST file
   int64_t timestamp = *(int64_t*)fragment.data();
-  int chunk_id = timestamp/fFullChunkLength;
-  bool overlap = (chunk_id+1)* fFullChunkLength - timestamp <= fChunkOverlap;
+  int chunk_id = fSchedule->ChunkOf(timestamp);
+  if (chunk_id < 0) {
+    // the adaptive schedule doesn't reach this far yet
+    if (fUnscheduled.size() == 0) fUnscheduledSince = SteadyNs();
+    fUnscheduled.emplace_back(std::move(fragment));
+    fOutputBufferSize += fFullFragmentSize;
+    fSchedule->Refresh();
+    return;
+  }
+  bool overlap = fSchedule->End(chunk_id) - timestamp <= fChunkOverlap;
+  if (chunk_id < fEmptyVerified) {
+    // this chunk is already on disk, don't make a second one with the same name
+    (overlap ? fLateOverlaps : fLate)[chunk_id].emplace_back(std::move(fragment));
+    fOutputBufferSize += fFullFragmentSize;
+    fFragments++;
+    fLateFragments++;
+    return;
+  }
   int min_chunk(0), max_chunk(1);
   if (fChunks.size() > 0) {
     auto [min_iter, max_iter] = std::minmax_element(fChunks.begin(), fChunks.end(), 
@@ -259,15 +400,21 @@ void StraxFormatter::AddFragmentToBuffer(std::string fragment, uint32_t ts, int
 
   const short* channel = (const short*)(fragment.data()+14);
   if (min_chunk - chunk_id > fWarnIfChunkOlderThan) {
-    fLog->Entry(MongoLog::Warning,
-        "Thread %lx got data from ch %i that's in chunk %i instead of %i/%i (ts %lx), it might get lost (ts %lx ro %i)",
+    fLog->LimitedEntry(MongoLog::Warning,
+        "Thread %lx got data from ch %i that's in chunk %i instead of %i/%i (ts %lx, header ts %x ro %i)",
         fThreadId, *channel, chunk_id, min_chunk, max_chunk, timestamp, ts, rollovers);
   } else if (chunk_id - max_chunk > 1) {
-    fLog->Entry(MongoLog::Message, "Thread %lx skipped %i chunk(s) (ch%i)",
+    fLog->LimitedEntry(MongoLog::Message, "Thread %lx skipped %i chunk(s) (ch%i)",
         fThreadId, chunk_id - max_chunk - 1, *channel);
   }
 
   fOutputBufferSize += fFullFragmentSize;
+  fFragments++;
+  if (chunk_id != fLastChunk) {
+    auto [it, added] = fChunkReadTime.emplace(chunk_id, fCurrentReadTime);
+    if (!added) it->second = std::min(it->second, fCurrentReadTime);
+    fLastChunk = chunk_id;
+  }
 
   if(!overlap){
     fChunks[chunk_id].emplace_back(std::move(fragment));
@@ -276,35 +423,134 @@ void StraxFormatter::AddFragmentToBuffer(std::string fragment, uint32_t ts, int
   }
 }
 
-void StraxFormatter::ReceiveDatapackets(std::list<std::unique_ptr<data_packet>>& in, int bytes) {
+void StraxFormatter::ReceiveDatapackets(std::list<std::unique_ptr<data_packet>>& in, long bytes) {
+  bool spill = false;
   {
-    const std::lock_guard<std::mutex> lk(fBufferMutex);
-    fBufferCounter[in.size()]++;
-    fBuffer.splice(fBuffer.end(), in);
-    fInputBufferSize += bytes;
+    const std::lock_guard<NamedMutex> lk(fBufferMutex);
+    fBufferCounter.Fill(in.size());
+    // Readout moves the watermark only after queueing, so anything older than
+    // this is already in some formatter's queue, and if it's ours, ahead of these
+    int64_t watermark = fWatermark != nullptr ? fWatermark->load(std::memory_order_acquire) : 0;
+    for (auto& dp : in) dp->watermark = watermark;
+    // Past the threshold everything goes to disk until we've caught up, so
+    // the packets still come out in the order they went in
+    if (fSpill.IsOpen() && (fSpilling || fInputBufferSize + bytes > fSpillThreshold)) {
+      if (!fSpilling) {
+        fSpilling = true;
+        fSpillEvents++;
+        fLog->Entry(MongoLog::Local, "Input queue at %.1f MB, spilling to disk",
+            fInputBufferSize/1e6);
+      }
+      if (fSpillFailed) {
+        // can't add to the file, but what's in it is older than this
+        fAfterSpill.splice(fAfterSpill.end(), in);
+        fInputBufferSize += bytes;
+      } else {
+        spill = true;
+        fSpillPushing++;
+      }
+    } else {
+      fBuffer.splice(fBuffer.end(), in);
+      fInputBufferSize += bytes;
+    }
+    fMaxInputBufferSize = std::max<long>(fMaxInputBufferSize, fInputBufferSize);
+  }
+  if (spill) {
+    // write without the lock, the processing thread keeps going meanwhile
+    long spilled = 0;
+    int err = 0;
+    while (in.size() > 0) {
+      long written = fSpill.Push(*in.front());
+      if (written < 0) {
+        err = errno;
+        break;
+      }
+      spilled += written;
+      bytes -= in.front()->buff.size()*sizeof(char32_t);
+      in.pop_front();
+    }
+    const std::lock_guard<NamedMutex> lk(fBufferMutex);
+    fSpillPushing--;
+    fBytesSpilled += spilled;
+    fMaxSpill = std::max(fMaxSpill, fSpill.Bytes());
+    if (in.size() > 0) {
+      // the rest waits in memory until the file is read back, then no more spilling
+      if (!fSpillFailed)
+        fLog->Entry(MongoLog::Warning, "Can't write to the spill file (%s), keeping the rest in memory",
+            std::strerror(err));
+      fSpillFailed = true;
+      fSpillThreshold = std::numeric_limits<long>::max();
+      fAfterSpill.splice(fAfterSpill.end(), in);
+      fInputBufferSize += bytes;
+      fMaxInputBufferSize = std::max<long>(fMaxInputBufferSize, fInputBufferSize);
+    }
   }
   fCV.notify_one();
 }
 
 void StraxFormatter::Process() {
   // this func runs in its own thread
-  fThreadId = std::this_thread::get_id();
+  fThreadId = pthread_self();
+  pthread_setname_np(pthread_self(), "redax_fmt");
   std::stringstream ss;
   ss<<fHostname<<'_'<<fThreadId;
   fFullHostname = ss.str();
   fActive = true;
+  std::string error;
+  if (fUsePerfCounters && fPerf.Open(error))
+    fLog->Entry(MongoLog::Message, "Hardware counters not available, continuing without: %s",
+        error.c_str());
+  if (fUseUring && fFileWriter->Sync()) {
+    fLog->Entry(MongoLog::Message, "Every file gets synced for the manifest, not using io_uring");
+  } else if (fUseUring) {
+    fUring = std::make_unique<UringWriter>();
+    if (fUring->Open(fUringDepth, error)) {
+      fLog->Entry(MongoLog::Message, "No io_uring, writing chunks the usual way: %s", error.c_str());
+      fUring.reset();
+    }
+  }
   std::unique_ptr<data_packet> dp;
-  while (fActive == true || fBuffer.size() > 0) {
-    std::unique_lock<std::mutex> lk(fBufferMutex);
-    fCV.wait(lk, [&]{return fBuffer.size() > 0 || fActive == false;});
+  auto ready = [&]{return fBuffer.size() > 0 || !fSpill.Empty() || fActive == false || fDrain == true ||
+    (fSpilling && fSpillPushing == 0);};
+  while (fActive == true || fBuffer.size() > 0 || !fSpill.Empty() || fAfterSpill.size() > 0) {
+    NamedLock lk(fBufferMutex);
+    if (fUring && fUring->InFlight() > 0) {
+      // come back now and then for the writes that finished
+      if (!fCV.wait_for(lk, std::chrono::milliseconds(10), ready)) {
+        lk.unlock();
+        ReapWrites(false);
+        continue;
+      }
+    } else {
+      fCV.wait(lk, ready);
+    }
     if (fBuffer.size() > 0) {
       dp = std::move(fBuffer.front());
       fBuffer.pop_front();
       lk.unlock();
       ProcessDatapacket(std::move(dp));
       if (fActive == true) WriteOutChunks();
+    } else if (!fSpill.Empty()) {
+      // memory's empty, so the oldest data is on disk
+      lk.unlock();
+      if (fSpill.Pop(dp) > 0) {
+        fInputBufferSize += dp->buff.size()*sizeof(char32_t);
+        ProcessDatapacket(std::move(dp));
+        if (fActive == true) WriteOutChunks();
+      } else {
+        fLog->Entry(MongoLog::Error, "Can't read back the spill file, %.1f MB lost: %s",
+            fSpill.Bytes()/1e6, std::strerror(errno));
+        fSpill.Discard();
+      }
     } else {
+      if (fSpilling && fSpillPushing == 0) {
+        fSpilling = false;
+        fSpill.Reset();
+        fBuffer.splice(fBuffer.end(), fAfterSpill);
+        fLog->Entry(MongoLog::Local, "Caught up with the spill file");
+      }
       lk.unlock();
+      if (fDrain == true && fActive == true) WriteOutChunks();
     }
   }
   if (fBytesProcessed > 0)
@@ -321,81 +567,277 @@ static const LZ4F_preferences_t kPrefs = {
 
 void StraxFormatter::WriteOutChunk(int chunk_i){
   // Write the contents of the buffers to compressed files
-  struct timespec comp_start, comp_end;
-  clock_gettime(CLOCK_THREAD_CPUTIME_ID, &comp_start);
+  uint64_t comp_start(0);
+  if (fInstrumentation != kOff) comp_start = ThreadCPUTime();
+  perf_values_t perf_start = fPerf.Read();
+  int64_t sealed = SteadyNs(), oldest = 0;
+  if (auto it = fChunkReadTime.find(chunk_i); it != fChunkReadTime.end()) {
+    oldest = it->second;
+    fChunkReadTime.erase(it);
+    fLatencySeal.Fill((sealed - oldest)/1000);
+  }
 
   std::vector<std::list<std::string>*> buffers{{&fChunks[chunk_i], &fOverlaps[chunk_i]}};
-  std::vector<long> uncompressed_size(3, 0);
-  std::string uncompressed;
-  std::vector<std::shared_ptr<std::string>> out_buffer(3);
-  std::vector<int> wsize(3);
-  long max_compressed_size = 0;
+  std::vector<long> uncompressed_size(2, 0);
+  std::vector<std::shared_ptr<std::string>> out_buffer(2);
+  std::vector<int> wsize(2);
+  std::vector<chunk_meta_t> meta(2);
 
   for (int i = 0; i < 2; i++) {
     if (buffers[i]->size() == 0) continue;
     uncompressed_size[i] = buffers[i]->size()*fFullFragmentSize;
-    uncompressed.reserve(uncompressed_size[i]);
-    for (auto it = buffers[i]->begin(); it != buffers[i]->end(); it++)
-      uncompressed += *it; // std::accumulate would be nice but 3x slower without -O2
-    // (also only works on c++20 because std::move, but still)
-    buffers[i]->clear();
-    if(fCompressor == "blosc"){
-      max_compressed_size = uncompressed_size[i] + BLOSC_MAX_OVERHEAD;
-      out_buffer[i] = std::make_shared<std::string>(max_compressed_size, 0);
-      wsize[i] = blosc_compress_ctx(5, 1, sizeof(char), uncompressed_size[i],
-          uncompressed.data(), out_buffer[i]->data(), max_compressed_size,"lz4", 0, 2);
-    }else{
-      // Note: the current package repo version for Ubuntu 18.04 (Oct 2019) is 1.7.1, which is
-      // so old it is not tracked on the lz4 github. The API for frame compression has changed
-      // just slightly in the meantime. So if you update and it breaks you'll have to tune at least
-      // the LZ4F_preferences_t object to the new format.
-      max_compressed_size = LZ4F_compressFrameBound(uncompressed_size[i], &kPrefs);
-      out_buffer[i] = std::make_shared<std::string>(max_compressed_size, 0);
-      wsize[i] = LZ4F_compressFrame(out_buffer[i]->data(), max_compressed_size,
-          uncompressed.data(), uncompressed_size[i], &kPrefs);
-    }
-    uncompressed.clear();
-    fBytesPerChunk[int(std::log2(uncompressed_size[i]))]++;
+    wsize[i] = Compress(*buffers[i], out_buffer[i], meta[i]);
+    fBytesPerChunk.Fill(uncompressed_size[i]);
+    fBytesUncompressed += uncompressed_size[i];
+    fBytesCompressed += wsize[i];
     fOutputBufferSize -= uncompressed_size[i];
   }
   fChunks.erase(chunk_i);
   fOverlaps.erase(chunk_i);
 
-  out_buffer[2] = out_buffer[1];
-  wsize[2] = wsize[1];
-  uncompressed_size[2] = uncompressed_size[1];
   auto names = GetChunkNames(chunk_i);
-  for (int i = 0; i < 3; i++) {
+  // _pre has the same contents as _post, so it's a link to it where that works
+  std::vector<std::pair<std::string, std::string>> targets[2] = {
+    {{names[0], fFullHostname}}, {{names[1], fFullHostname}, {names[2], fFullHostname}}};
+  // the chunk is written once all its files are, which can be after we return
+  auto remaining = std::make_shared<int>(1); // one for us, one per file
+  auto done = [this, remaining, sealed, oldest, chunk_i]{
+    if (--*remaining > 0) return;
+    int64_t written = SteadyNs();
+    fLatencyWrite.Fill((written - sealed)/1000);
+    if (fTraceEvery > 0 && fTrace.size() < max_trace_events) {
+      if (oldest != 0) fTrace.push_back({"chunk_fill", "chunk", oldest, sealed - oldest, chunk_i});
+      fTrace.push_back({"chunk_write", "chunk", sealed, written - sealed, chunk_i});
+    }
+  };
+  for (int i = 0; i < 2; i++) {
     if (uncompressed_size[i] == 0) continue;
-    // write to *_TEMP
-    auto output_dir_temp = GetDirectoryPath(names[i], true);
-    auto filename_temp = GetFilePath(names[i], true);
-    if (!fs::exists(output_dir_temp))
-      fs::create_directory(output_dir_temp);
-    std::ofstream writefile(filename_temp, std::ios::binary);
-    writefile.write(out_buffer[i]->data(), wsize[i]);
-    writefile.close();
+    (*remaining)++;
+    Output(targets[i], out_buffer[i], wsize[i], meta[i], uncompressed_size[i], done);
     out_buffer[i].reset();
+  } // End writing
+  if (fInstrumentation != kOff) fCompTime += (ThreadCPUTime() - comp_start)/1e3;
+  if (fPerf.IsOpen()) fPerfComp += fPerf.Read() - perf_start;
+  done();
+  return;
+}
 
-    auto output_dir = GetDirectoryPath(names[i]);
-    auto filename = GetFilePath(names[i]);
-    // shenanigans or skulduggery?
-    if(fs::exists(filename)) {
-      fLog->Entry(MongoLog::Warning, "Chunk %s from thread %lx already exists? %li vs %li bytes (%lx)",
-          names[i].c_str(), fThreadId, fs::file_size(filename), wsize[i], uncompressed_size[i]);
+int StraxFormatter::Compress(std::list<std::string>& frags, std::shared_ptr<std::string>& out,
+    chunk_meta_t& meta) {
+  // Concatenates and compresses the fragments (and empties the list), returns the compressed size
+  long uncompressed_size = frags.size()*fFullFragmentSize, max_compressed_size = 0;
+  int wsize = 0;
+  std::string uncompressed;
+  uncompressed.reserve(uncompressed_size);
+  meta.first_time = std::numeric_limits<int64_t>::max();
+  meta.last_time = std::numeric_limits<int64_t>::min();
+  meta.fragments = frags.size();
+  if (fWriteMetadata) meta.channels.assign(fNumChannels, 0);
+  for (auto it = frags.begin(); it != frags.end(); it++) {
+    if (fWriteMetadata) {
+      int64_t t = *(const int64_t*)it->data();
+      meta.first_time = std::min(meta.first_time, t);
+      meta.last_time = std::max(meta.last_time, t);
+      int16_t ch = *(const int16_t*)(it->data()+14);
+      if (ch >= (int)meta.channels.size()) meta.channels.resize(ch+1, 0);
+      if (ch >= 0) meta.channels[ch]++;
     }
+    uncompressed += *it; // std::accumulate would be nice but 3x slower without -O2
+  }
+  // (also only works on c++20 because std::move, but still)
+  frags.clear();
+  if(fCompressor == "blosc"){
+    max_compressed_size = uncompressed_size + BLOSC_MAX_OVERHEAD;
+    out = std::make_shared<std::string>(max_compressed_size, 0);
+    wsize = blosc_compress_ctx(5, 1, sizeof(char), uncompressed_size,
+        uncompressed.data(), out->data(), max_compressed_size,"lz4", 0, 2);
+  }else{
+    // Note: the current package repo version for Ubuntu 18.04 (Oct 2019) is 1.7.1, which is
+    // so old it is not tracked on the lz4 github. The API for frame compression has changed
+    // just slightly in the meantime. So if you update and it breaks you'll have to tune at least
+    // the LZ4F_preferences_t object to the new format.
+    max_compressed_size = LZ4F_compressFrameBound(uncompressed_size, &kPrefs);
+    out = std::make_shared<std::string>(max_compressed_size, 0);
+    wsize = LZ4F_compressFrame(out->data(), max_compressed_size,
+        uncompressed.data(), uncompressed_size, &kPrefs);
+  }
+  // still in cache
+  meta.xxhash = fWriteMetadata && wsize > 0 ? XXHash::Hash64(out->data(), wsize) : 0;
+  return wsize;
+}
 
-    // Move this chunk from *_TEMP to the same path without TEMP
-    if(!fs::exists(output_dir))
-      fs::create_directory(output_dir);
-    fs::rename(filename_temp, filename);
-  } // End writing
-  clock_gettime(CLOCK_THREAD_CPUTIME_ID, &comp_end);
-  fCompTime += timespec_subtract(comp_end, comp_start);
-  return;
+std::string StraxFormatter::MetadataFields(const chunk_meta_t& meta, long uncompressed_size,
+    int compressed_size) {
+  // goes on the file's manifest line rather than into a file of its own
+  std::stringstream out;
+  char hash[17];
+  std::snprintf(hash, sizeof(hash), "%016lx", (unsigned long)meta.xxhash);
+  out << "\"first_time\": " << meta.first_time << ", \"last_time\": " << meta.last_time << ", " <<
+    "\"fragments\": " << meta.fragments << ", " <<
+    "\"uncompressed_bytes\": " << uncompressed_size << ", \"compressed_bytes\": " << compressed_size << ", " <<
+    "\"compressor\": \"" << fCompressor << "\", \"xxhash64\": \"" << hash << "\", \"channels\": {";
+  bool first = true;
+  for (unsigned ch = 0; ch < meta.channels.size(); ch++) {
+    if (meta.channels[ch] == 0) continue;
+    out << (first ? "" : ", ") << '"' << ch << "\": " << meta.channels[ch];
+    first = false;
+  }
+  out << "}";
+  return out.str();
+}
+
+int StraxFormatter::WriteFile(const std::string& name, const std::string& file,
+    const std::string& buffer, int size, const std::string& same_as) {
+  if (same_as != "")
+    return fFileWriter->Link(same_as, GetDirectoryPath(name), file, buffer.data(), size);
+  return fFileWriter->Publish(GetDirectoryPath(name), file, buffer.data(), size);
+}
+
+void StraxFormatter::Output(const std::vector<std::pair<std::string, std::string>>& targets,
+    std::shared_ptr<std::string> buffer, int size, const chunk_meta_t& meta, long uncompressed_size,
+    std::function<void()> then) {
+  // Puts buffer in each of targets ({chunk name, file}), the first one written
+  // and the others links to it. Through io_uring this returns once it's
+  // submitted and the rest happens from ReapWrites
+  int64_t start = SteadyNs();
+  auto finish = [this, targets, buffer, size, meta, uncompressed_size, then](int placed) {
+    // whatever io_uring didn't manage is done the usual way
+    std::string first = GetDirectoryPath(targets[0].first) / targets[0].second;
+    std::vector<bool> written(targets.size(), true);
+    for (unsigned i = placed; i < targets.size(); i++) {
+      int ret = WriteFile(targets[i].first, targets[i].second, *buffer, size, i > 0 ? first : "");
+      if (ret == 1) {
+        // shenanigans or skulduggery?
+        fLog->Entry(MongoLog::Warning, "Chunk %s from thread %lx already existed? Replaced it with %i bytes (%lx)",
+            targets[i].first.c_str(), fThreadId, size, uncompressed_size);
+      } else if (ret < 0) {
+        // the FileWriter said why, the manifest mustn't list it
+        fLog->Entry(MongoLog::Error, "Thread %lx lost %s/%s (%i bytes)",
+            fThreadId, targets[i].first.c_str(), targets[i].second.c_str(), size);
+        written[i] = false;
+        fFailedWrites++;
+      }
+    }
+    std::string fields = fManifest && fWriteMetadata ? MetadataFields(meta, uncompressed_size, size) : "";
+    for (unsigned i = 0; i < targets.size(); i++) {
+      auto& [name, file] = targets[i];
+      if (fManifest && written[i]) fManifest->Add(name, file, size, fields);
+      if (auto it = fWriting.find(name); it != fWriting.end()) fWriting.erase(it);
+    }
+    if (then) then();
+  };
+  fWriteBytes += size;
+  bool submitted = false;
+  if (fUring) {
+    std::vector<std::pair<std::string, std::string>> paths;
+    for (auto& [name, file] : targets) {
+      fFileWriter->MakeDirectory(GetDirectoryPath(name));
+      paths.emplace_back(GetDirectoryPath(name), file);
+      fWriting.insert(name);
+    }
+    submitted = fUring->Submit(paths, buffer, size, finish) == 0;
+  }
+  if (!submitted) finish(0);
+  fWriteTime += (SteadyNs() - start)/1e3;
+}
+
+void StraxFormatter::ReapWrites(bool all) {
+  if (!fUring || fUring->InFlight() == 0) return;
+  int64_t start = SteadyNs();
+  if (all) fUring->Drain();
+  else fUring->Reap(false);
+  fWriteTime += (SteadyNs() - start)/1e3;
+}
+
+void StraxFormatter::WriteOutLate() {
+  // Each chunk with late fragments gets one more file next to the one we
+  // already wrote, strax merges everything in a chunk's directory
+  fLateFlushed = fEmptyVerified;
+  std::set<int> ids;
+  for (auto& [id, frags] : fLate) ids.insert(id);
+  for (auto& [id, frags] : fLateOverlaps) ids.insert(id);
+  for (int id : ids) {
+    std::list<std::string>* buffers[2] = {&fLate[id], &fLateOverlaps[id]};
+    auto names = GetChunkNames(id);
+    int frags = buffers[0]->size() + buffers[1]->size();
+    for (int i = 0; i < 2; i++) {
+      if (buffers[i]->size() == 0) continue;
+      long uncompressed_size = buffers[i]->size()*fFullFragmentSize;
+      std::shared_ptr<std::string> out;
+      chunk_meta_t meta;
+      int wsize = Compress(*buffers[i], out, meta);
+      fBytesUncompressed += uncompressed_size;
+      fBytesCompressed += wsize;
+      fOutputBufferSize -= uncompressed_size;
+      // overlaps go into both _post and the next chunk's _pre, same as on time
+      std::vector<std::pair<std::string, std::string>> targets;
+      for (int j : (i == 0 ? std::vector<int>{0} : std::vector<int>{1, 2})) {
+        targets.emplace_back(names[j], fFullHostname + "_late" + std::to_string(fLateFileCount[names[j]]++));
+        fLateFiles++;
+      }
+      Output(targets, out, wsize, meta, uncompressed_size);
+    }
+    fLog->Entry(MongoLog::Local, "Thread %lx wrote %i late fragment(s) for chunk %i",
+        fThreadId, frags, id);
+  }
+  fLate.clear();
+  fLateOverlaps.clear();
+}
+
+void StraxFormatter::AddUnscheduled() {
+  fSchedule->Refresh();
+  if (fSchedule->Known() == fUnscheduledKnown) return;
+  fUnscheduledKnown = fSchedule->Known();
+  std::list<std::string> frags;
+  frags.swap(fUnscheduled);
+  fOutputBufferSize -= frags.size()*fFullFragmentSize;
+  for (auto& frag : frags) AddFragmentToBuffer(std::move(frag), 0, 0);
 }
 
 void StraxFormatter::WriteOutChunks() {
+  ReapWrites(false);
+  if (fUnscheduled.size() > 0) {
+    AddUnscheduled();
+    int64_t waited = SteadyNs() - fUnscheduledSince;
+    if (fUnscheduled.size() > 0 && waited > fScheduleTimeout) {
+      // the leader is gone or stuck, don't hold on to them until we run out of memory
+      fLog->Entry(MongoLog::Error, "Thread %lx: chunk schedule stuck at %i chunks for %.0f s, dropping %i fragments past it",
+          fThreadId, fSchedule->Known(), waited/1e9, (int)fUnscheduled.size());
+      fOutputBufferSize -= fUnscheduled.size()*fFullFragmentSize;
+      fUnscheduled.clear();
+    }
+  }
+  // late fragments go out whenever the written chunks catch up with them
+  if ((fLate.size() > 0 || fLateOverlaps.size() > 0) && fEmptyVerified > fLateFlushed)
+    WriteOutLate();
+  if (fDrain.exchange(false)) {
+    // anything still on its way for this chunk goes out as late fragments
+    int oldest = std::min(fChunks.size() ? fChunks.begin()->first : INT_MAX,
+        fOverlaps.size() ? fOverlaps.begin()->first : INT_MAX);
+    if (oldest != INT_MAX) {
+      fLog->LimitedEntry(MongoLog::Message, "Thread %lx sealing chunk %i early, readout is paused on output memory",
+          fThreadId, oldest);
+      WriteOutChunk(oldest);
+      CreateEmpty(oldest+1);
+    }
+  }
+  if (fSealByWatermark && fWatermark != nullptr) {
+    // Every link has queued everything before the watermark on the last
+    // packet we processed, so a chunk is complete once that's past its end,
+    // plus the overlap to be safe
+    int64_t watermark = fQueuedWatermark;
+    if (watermark <= 0 || (fChunks.size() == 0 && fOverlaps.size() == 0)) return;
+    int last_complete = fSchedule->Complete(watermark - fChunkOverlap) - 1;
+    int min_chunk = std::min(fChunks.size() ? fChunks.begin()->first : INT_MAX,
+        fOverlaps.size() ? fOverlaps.begin()->first : INT_MAX);
+    if (min_chunk > last_complete) return;
+    for (; min_chunk <= last_complete; min_chunk++) {
+      if (fChunks.count(min_chunk) || fOverlaps.count(min_chunk))
+        WriteOutChunk(min_chunk);
+    }
+    CreateEmpty(min_chunk);
+    return;
+  }
   int min_chunk(999999), max_chunk(0), tot_frags(0), n_frags(0);
   double average_chunk(0);
   for (auto it = fChunks.begin(); it != fChunks.end(); it++) {
@@ -414,6 +856,17 @@ void StraxFormatter::WriteOutChunks() {
 }
 
 void StraxFormatter::End() {
+  // give the leader a few seconds to get to our last fragments
+  for (int i = 0; i < 50 && fUnscheduled.size() > 0; i++) {
+    std::this_thread::sleep_for(std::chrono::milliseconds(100));
+    AddUnscheduled();
+  }
+  if (fUnscheduled.size() > 0) {
+    fLog->Entry(MongoLog::Warning, "Thread %lx lost %i fragments past the end of the chunk schedule",
+        fThreadId, (int)fUnscheduled.size());
+    fOutputBufferSize -= fUnscheduled.size()*fFullFragmentSize;
+    fUnscheduled.clear();
+  }
   // this line is awkward, but iterators don't always like it when you're
   // changing the container while looping over its contents
   int max_chunk = -1;
@@ -423,17 +876,13 @@ void StraxFormatter::End() {
   }
   if (max_chunk != -1) CreateEmpty(max_chunk);
   fChunks.clear();
-  auto end_dir = GetDirectoryPath("THE_END");
-  if(!fs::exists(end_dir)){
-    fLog->Entry(MongoLog::Local,"Creating END directory at %s", end_dir.c_str());
-    try{
-      fs::create_directory(end_dir);
-    }
-    catch(...){};
-  }
-  std::ofstream outfile(GetFilePath("THE_END"), std::ios::out);
-  outfile<<"...my only friend\n";
-  outfile.close();
+  if (fLate.size() > 0 || fLateOverlaps.size() > 0) WriteOutLate();
+  ReapWrites(true);
+  const std::string the_end = "...my only friend\n";
+  if (fFileWriter->Publish(GetDirectoryPath("THE_END"), fFullHostname, the_end.data(), the_end.size()) < 0)
+    fFailedWrites++;
+  else if (fManifest)
+    fManifest->Add("THE_END", fFullHostname, the_end.size());
   return;
 }
 
@@ -444,27 +893,24 @@ std::string StraxFormatter::GetStringFormat(int id){
   return chunk_index;
 }
 
-fs::path StraxFormatter::GetDirectoryPath(const std::string& id, bool temp){
+fs::path StraxFormatter::GetDirectoryPath(const std::string& id){
   fs::path write_path(fOutputPath);
   write_path /= id;
-  if(temp)
-    write_path+="_temp";
   return write_path;
 }
 
-fs::path StraxFormatter::GetFilePath(const std::string& id, bool temp){
-  return GetDirectoryPath(id, temp) / fFullHostname;
-}
-
 void StraxFormatter::CreateEmpty(int back_from){
+  if (back_from - fEmptyVerified > fMaxEmptyPerCall) {
+    // a bad timestamp can get this far, so go there a bit at a time
+    fLog->LimitedEntry(MongoLog::Warning, "Thread %lx jumping from chunk %i to %i, %i at a time",
+        fThreadId, fEmptyVerified, back_from, fMaxEmptyPerCall);
+    back_from = fEmptyVerified + fMaxEmptyPerCall;
+  }
   for(; fEmptyVerified<back_from; fEmptyVerified++){
     for (auto& n : GetChunkNames(fEmptyVerified)) {
-      if(!fs::exists(GetFilePath(n))){
-        if(!fs::exists(GetDirectoryPath(n)))
-          fs::create_directory(GetDirectoryPath(n));
-        std::ofstream o(GetFilePath(n));
-        o.close();
-      }
+      if (fWriting.count(n)) continue; // on its way
+      if (fFileWriter->CreateEmpty(GetDirectoryPath(n), fFullHostname) == 1 && fManifest)
+        fManifest->Add(n, fFullHostname, 0);
     } // name
   } // chunks
 }
@@ -13,20 +13,37 @@
 #include <thread>
 #include <condition_variable>
 #include <list>
+#include <set>
+#include <functional>
 #include <memory>
 #include <string_view>
+#include <chrono>
+#include "Histogram.hh"
+#include "PerfCounters.hh"
+#include "NamedMutex.hh"
+#include "SpillQueue.hh"
+#include "ChunkSchedule.hh"
+#include "Manifest.hh"
+#include "FileWriter.hh"
+#include "UringWriter.hh"
 
 class Options;
 class MongoLog;
 class V1724;
 
+inline int64_t SteadyNs() {
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(
+      std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
 struct data_packet{
-  data_packet() : clock_counter(0), header_time(0) {}
+  data_packet() : clock_counter(0), header_time(0), read_time(SteadyNs()), watermark(0) {}
   data_packet(std::u32string s, uint32_t ht, long cc) :
-      buff(std::move(s)), clock_counter(cc), header_time(ht) {}
+      buff(std::move(s)), clock_counter(cc), header_time(ht), read_time(SteadyNs()), watermark(0) {}
   data_packet(const data_packet& rhs)=delete;
   data_packet(data_packet&& rhs) : buff(std::move(rhs.buff)),
-      clock_counter(rhs.clock_counter), header_time(rhs.header_time), digi(rhs.digi) {}
+      clock_counter(rhs.clock_counter), header_time(rhs.header_time),
+      read_time(rhs.read_time), watermark(rhs.watermark), digi(rhs.digi) {}
   ~data_packet() {buff.clear(); digi.reset();}
 
   data_packet& operator=(const data_packet& rhs)=delete;
@@ -34,6 +51,8 @@ struct data_packet{
     buff=std::move(rhs.buff);
     clock_counter=rhs.clock_counter;
     header_time=rhs.header_time;
+    read_time=rhs.read_time;
+    watermark=rhs.watermark;
     digi=rhs.digi;
     return *this;
   }
@@ -41,9 +60,45 @@ struct data_packet{
   std::u32string buff;
   long clock_counter;
   uint32_t header_time;
+  int64_t read_time; // steady clock ns, made right as V1724::Read returns
+  int64_t watermark; // ns, the readout watermark when this was queued
   std::shared_ptr<V1724> digi;
 };
 
+// What one formatter thread did over a run, for the run report
+struct formatter_stats_t {
+  std::string thread;
+  double data_packets_us, events_us, fragments_us, compression_us; // thread CPU time
+  long bytes_in; // raw data processed
+  long bytes_uncompressed, bytes_compressed;
+  long fragments;
+  long max_input_buffer; // bytes
+  int spill_events; // times the input queue went to disk
+  long bytes_spilled, max_spill;
+  long late_fragments; // for chunks that were already written
+  int late_files;
+  int failed_writes; // files that didn't make it to disk
+  long write_bytes; // compressed, handed to the output
+  double write_us; // time the thread spent on that
+  perf_values_t perf_data_packets, perf_compression; // zero unless perf_counters is on
+};
+
+// One span for the Chrome trace-event dump
+struct trace_event_t {
+  const char* name;
+  const char* category; // what id is, "board" or "chunk"
+  int64_t start, duration; // steady clock ns
+  int id;
+};
+
+// What's in one chunk file, for its line in the manifest
+struct chunk_meta_t {
+  int64_t first_time, last_time; // ns, of the earliest and latest fragment
+  long fragments;
+  std::vector<int> channels; // fragments per channel number
+  uint64_t xxhash; // XXH64 of the compressed file
+};
+
 class StraxFormatter{
   /*
     Reformats raw data into strax format
@@ -56,25 +111,46 @@ public:
   void Close(std::map<int,int>& ret);
 
   void Process();
-  std::pair<int, int> GetBufferSize() {return {fInputBufferSize.load(), fOutputBufferSize.load()};}
+  std::pair<long, long> GetBufferSize() {return {fInputBufferSize.load(), fOutputBufferSize.load()};}
+  long GetSpillSize() {return fSpill.Bytes();}
+  // Readout is paused on our output memory, so nothing will move the
+  // watermark (or the average chunk): seal the oldest chunk anyway
+  void Drain() {fDrain = true; fCV.notify_one();}
+  void SetWatermark(const std::atomic<int64_t>* wm) {fWatermark = wm;}
+  void SetSchedule(std::shared_ptr<ChunkSchedule> s) {fSchedule = s;}
+  void SetManifest(std::shared_ptr<Manifest> m) {fManifest = m;}
+  void SetFileWriter(std::shared_ptr<FileWriter> w) {fFileWriter = w;}
   void GetDataPerChan(std::map<int, int>& ret);
-  void ReceiveDatapackets(std::list<std::unique_ptr<data_packet>>&, int);
+  std::map<std::string, const Histogram*> GetHistograms();
+  formatter_stats_t GetRunStats();
+  std::pair<long, long> GetCompressedBytes() {return {fBytesUncompressed.load(), fBytesCompressed.load()};}
+  std::map<std::string, const Histogram*> GetLatencies();
+  std::vector<trace_event_t>& GetTrace() {return fTrace;}
+  std::string GetOutputPath() {return fOutputPath;}
+  void ReceiveDatapackets(std::list<std::unique_ptr<data_packet>>&, long);
 
 private:
   void ProcessDatapacket(std::unique_ptr<data_packet> dp);
-  int ProcessEvent(std::u32string_view, const std::unique_ptr<data_packet>&,
-      std::map<int, int>&);
+  int ProcessEvent(std::u32string_view, const std::unique_ptr<data_packet>&, bool);
   int ProcessChannel(std::u32string_view, int, int, uint32_t, int&, int,
-      const std::unique_ptr<data_packet>&, std::map<int, int>&);
+      const std::unique_ptr<data_packet>&);
   void WriteOutChunk(int);
   void WriteOutChunks();
+  void WriteOutLate();
+  void AddUnscheduled();
+  int Compress(std::list<std::string>&, std::shared_ptr<std::string>&, chunk_meta_t&);
+  int WriteFile(const std::string&, const std::string&, const std::string&, int,
+      const std::string& same_as="");
+  std::string MetadataFields(const chunk_meta_t&, long, int);
+  void Output(const std::vector<std::pair<std::string, std::string>>&, std::shared_ptr<std::string>,
+      int, const chunk_meta_t&, long, std::function<void()> then=nullptr);
+  void ReapWrites(bool);
   void End();
   void GenerateArtificialDeadtime(int64_t, const std::shared_ptr<V1724>&);
   void AddFragmentToBuffer(std::string, uint32_t, int);
   std::vector<std::string> GetChunkNames(int);
 
-  std::experimental::filesystem::path GetFilePath(const std::string&, bool=false);
-  std::experimental::filesystem::path GetDirectoryPath(const std::string&, bool=false);
+  std::experimental::filesystem::path GetDirectoryPath(const std::string&);
   std::string GetStringFormat(int id);
   void CreateEmpty(int);
   int fEmptyVerified;
@@ -84,31 +160,100 @@ private:
   int fFragmentBytes;
   int fStraxHeaderSize; // bytes
   int fFullFragmentSize;
-  int fBufferNumChunks;
+  int fBufferNumChunks; // for the "average" sealing
+  bool fSealByWatermark;
+  const std::atomic<int64_t>* fWatermark; // ns, all data before this has been read out and queued
+  int64_t fQueuedWatermark; // newest stamp on a packet we've processed
+  int fMaxEmptyPerCall; // chunks CreateEmpty may go forward at once
   int fWarnIfChunkOlderThan;
   unsigned fChunkNameLength;
   int64_t fFullChunkLength;
+  std::shared_ptr<ChunkSchedule> fSchedule;
+  std::shared_ptr<Manifest> fManifest; // can be null
+  std::shared_ptr<FileWriter> fFileWriter; // shared with the other threads
+  // strax_io uring: this thread's own ring, files in flight are in fWriting
+  // (chunk names) so CreateEmpty leaves them alone
+  std::unique_ptr<UringWriter> fUring;
+  bool fUseUring;
+  int fUringDepth;
+  std::multiset<std::string> fWriting;
+  long fWriteBytes;
+  double fWriteTime; // us
+  // Fragments past the end of an adaptive schedule, until it gets there
+  std::list<std::string> fUnscheduled;
+  int fUnscheduledKnown; // chunks in the schedule when we last tried
+  int64_t fUnscheduledSince; // steady ns, when the schedule last grew for them
+  int64_t fScheduleTimeout; // ns
   std::string fOutputPath, fHostname, fFullHostname;
   std::shared_ptr<Options> fOptions;
   std::shared_ptr<MongoLog> fLog;
   std::atomic_bool fActive;
+  std::atomic_bool fDrain;
   std::string fCompressor;
+  bool fWriteMetadata;
   std::map<int, std::list<std::string>> fChunks, fOverlaps;
+  // Fragments for chunks that were already written (everything below
+  // fEmptyVerified), they go into extra files next to the chunk
+  std::map<int, std::list<std::string>> fLate, fLateOverlaps;
+  std::map<std::string, int> fLateFileCount; // per chunk name
+  int fLateFlushed; // fEmptyVerified at the last WriteOutLate
+  long fLateFragments;
+  int fLateFiles;
+  int fFailedWrites;
   std::map<int, int> fFailCounter;
-  std::map<int, int> fDataPerChan;
-  std::mutex fDPC_mutex;
-  std::map<int, long> fBufferCounter;
-  std::map<int, long> fFragsPerEvent;
-  std::map<int, long> fEvPerDP;
-  std::map<int, long> fBytesPerChunk;
-  std::atomic_int fInputBufferSize, fOutputBufferSize;
+  // Bytes per global channel. Only this thread adds, only the status thread
+  // takes, so relaxed atomics on our own cache lines are all that's needed
+  static const int kCountersPerLine = 8;
+  struct alignas(64) channel_counters_t {
+    std::atomic_long bytes[kCountersPerLine];
+  };
+  std::unique_ptr<channel_counters_t[]> fDataPerChan;
+  int fNumChannels;
+  std::map<int, std::vector<int16_t>> fChannelMap;
+  Histogram fBufferCounter; // data packets per transfer from readout
+  Histogram fFragsPerEvent;
+  Histogram fEvPerDP;
+  Histogram fBytesPerChunk; // uncompressed
+  std::atomic_long fInputBufferSize, fOutputBufferSize;
   long fBytesProcessed;
+  std::atomic_long fBytesUncompressed, fBytesCompressed; // also read live
+  long fFragments;
+  long fMaxInputBufferSize;
 
   double fProcTimeDP, fProcTimeEv, fProcTimeCh, fCompTime;
-  std::thread::id fThreadId;
-  std::condition_variable fCV;
-  std::mutex fBufferMutex;
+  // Stage timing in thread CPU time: off, sampled (1 in fSampleEvery events
+  // timed and scaled up), or full (around every event and channel)
+  enum {kOff, kSampled, kFull};
+  int fInstrumentation, fSampleEvery;
+  long fEventCounter;
+  uint64_t Stamp();
+  double Elapsed(uint64_t);
+  bool fUsePerfCounters;
+  PerfCounters fPerf; // opened by the processing thread
+  perf_values_t fPerfDP, fPerfComp;
+
+  // Latency (us) from V1724::Read to: formatter dequeue, done processing,
+  // chunk sealed (from the oldest packet in it), and seal to chunk renamed
+  Histogram fLatencyQueue, fLatencyProcess, fLatencySeal, fLatencyWrite;
+  int64_t fCurrentReadTime;
+  int fLastChunk;
+  std::map<int, int64_t> fChunkReadTime; // oldest packet in each open chunk
+  int fTraceEvery;
+  long fPacketCounter;
+  std::vector<trace_event_t> fTrace;
+  pthread_t fThreadId;
+  NamedCondVar fCV;
+  NamedMutex fBufferMutex{"formatter_buffer"};
   std::list<std::unique_ptr<data_packet>> fBuffer;
+  // Input that didn't fit in memory, see ReceiveDatapackets
+  SpillQueue fSpill;
+  long fSpillThreshold; // bytes in fBuffer
+  // guarded by fBufferMutex
+  bool fSpilling, fSpillFailed;
+  int fSpillPushing; // readout threads writing to fSpill right now
+  std::list<std::unique_ptr<data_packet>> fAfterSpill; // newer than the spill, once it can't be written
+  int fSpillEvents;
+  long fBytesSpilled, fMaxSpill;
 };
 
 #endif
@@ -0,0 +1,279 @@
+#include "UringWriter.hh"
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <algorithm>
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#if __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#define REDAX_HAVE_URING
+#endif
+
+static const std::size_t kAlign = 4096; // for O_DIRECT, fine for 512 and 4k sectors
+static const unsigned kKeepBuffers = 4;
+
+UringWriter::UringWriter() {
+  fRing = -1;
+  fEntries = 0;
+  fInFlight = 0;
+  fSqRing = fCqRing = fSqes = nullptr;
+  fSqRingSize = fCqRingSize = fSqesSize = 0;
+  fSqHead = fSqTail = fSqMask = fSqArray = nullptr;
+  fCqHead = fCqTail = fCqMask = nullptr;
+  fCqes = nullptr;
+}
+
+UringWriter::~UringWriter() {
+  if (fRing < 0) return;
+  Drain();
+  if (fSqes != nullptr) munmap(fSqes, fSqesSize);
+  if (fCqRing != nullptr && fCqRing != fSqRing) munmap(fCqRing, fCqRingSize);
+  if (fSqRing != nullptr) munmap(fSqRing, fSqRingSize);
+  close(fRing);
+  for (auto& [buffer, capacity] : fBuffers) free(buffer);
+}
+
+char* UringWriter::GetBuffer(std::size_t size, std::size_t& capacity) {
+  // smallest one that fits
+  auto best = fBuffers.end();
+  for (auto it = fBuffers.begin(); it != fBuffers.end(); it++)
+    if (it->second >= size && (best == fBuffers.end() || it->second < best->second)) best = it;
+  if (best != fBuffers.end()) {
+    char* ret = best->first;
+    capacity = best->second;
+    fBuffers.erase(best);
+    return ret;
+  }
+  char* ret = nullptr;
+  // a bit extra so the next, slightly larger chunk fits too
+  capacity = (size + size/8 + kAlign - 1) & ~(kAlign - 1);
+  if (posix_memalign((void**)&ret, kAlign, capacity)) return nullptr;
+  return ret;
+}
+
+void UringWriter::ReturnBuffer(char* buffer, std::size_t capacity) {
+  if (buffer == nullptr) return;
+  fBuffers.emplace_back(buffer, capacity);
+  if (fBuffers.size() <= kKeepBuffers) return;
+  // drop the smallest
+  auto smallest = std::min_element(fBuffers.begin(), fBuffers.end(),
+      [](auto& a, auto& b) {return a.second < b.second;});
+  free(smallest->first);
+  fBuffers.erase(smallest);
+}
+
+#ifdef REDAX_HAVE_URING
+
+int UringWriter::Open(unsigned depth, std::string& error) {
+  struct io_uring_params p;
+  std::memset(&p, 0, sizeof(p));
+  int fd = syscall(__NR_io_uring_setup, depth, &p);
+  if (fd < 0) {
+    error = std::string("io_uring_setup: ") + std::strerror(errno);
+    return -1;
+  }
+  // linkat came last, in 5.15
+  std::vector<char> probe_buffer(sizeof(io_uring_probe) + 256*sizeof(io_uring_probe_op), 0);
+  auto probe = (io_uring_probe*)probe_buffer.data();
+  if (syscall(__NR_io_uring_register, fd, IORING_REGISTER_PROBE, probe, 256) < 0 ||
+      probe->last_op < IORING_OP_LINKAT ||
+      !(probe->ops[IORING_OP_WRITE].flags & IO_URING_OP_SUPPORTED) ||
+      !(probe->ops[IORING_OP_LINKAT].flags & IO_URING_OP_SUPPORTED)) {
+    error = "this kernel's io_uring can't do linkat";
+    close(fd);
+    return -1;
+  }
+  bool single = p.features & IORING_FEAT_SINGLE_MMAP;
+  fSqRingSize = p.sq_off.array + p.sq_entries*sizeof(unsigned);
+  fCqRingSize = p.cq_off.cqes + p.cq_entries*sizeof(io_uring_cqe);
+  if (single) fSqRingSize = fCqRingSize = std::max(fSqRingSize, fCqRingSize);
+  fSqesSize = p.sq_entries*sizeof(io_uring_sqe);
+  fSqRing = mmap(nullptr, fSqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd,
+      IORING_OFF_SQ_RING);
+  fCqRing = single ? fSqRing : mmap(nullptr, fCqRingSize, PROT_READ | PROT_WRITE,
+      MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+  fSqes = mmap(nullptr, fSqesSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd,
+      IORING_OFF_SQES);
+  if (fSqRing == MAP_FAILED || fCqRing == MAP_FAILED || fSqes == MAP_FAILED) {
+    error = std::string("mmap: ") + std::strerror(errno);
+    if (fSqes != MAP_FAILED) munmap(fSqes, fSqesSize);
+    if (!single && fCqRing != MAP_FAILED) munmap(fCqRing, fCqRingSize);
+    if (fSqRing != MAP_FAILED) munmap(fSqRing, fSqRingSize);
+    fSqRing = fCqRing = fSqes = nullptr;
+    close(fd);
+    return -1;
+  }
+  char* sq = (char*)fSqRing;
+  fSqHead = (unsigned*)(sq + p.sq_off.head);
+  fSqTail = (unsigned*)(sq + p.sq_off.tail);
+  fSqMask = (unsigned*)(sq + p.sq_off.ring_mask);
+  fSqArray = (unsigned*)(sq + p.sq_off.array);
+  char* cq = (char*)fCqRing;
+  fCqHead = (unsigned*)(cq + p.cq_off.head);
+  fCqTail = (unsigned*)(cq + p.cq_off.tail);
+  fCqMask = (unsigned*)(cq + p.cq_off.ring_mask);
+  fCqes = cq + p.cq_off.cqes;
+  fEntries = p.sq_entries;
+  fRing = fd;
+  return 0;
+}
+
+int UringWriter::GetSqes(unsigned n) {
+  // the completion ring is twice the size, so as long as no more than this
+  // are in flight it can't overflow
+  if (n > fEntries) return -1;
+  while (fInFlight + n > fEntries) Reap(true);
+  return 0;
+}
+
+void UringWriter::Push(uint8_t opcode, int fd, uint64_t addr, uint32_t len, uint64_t off,
+    uint32_t flags, bool link, step_t* step) {
+  // we're the only producer, and we always submit everything we push
+  unsigned tail = *fSqTail;
+  unsigned idx = tail & *fSqMask;
+  auto sqe = &((io_uring_sqe*)fSqes)[idx];
+  std::memset(sqe, 0, sizeof(*sqe));
+  sqe->opcode = opcode;
+  sqe->flags = link ? IOSQE_IO_LINK : 0;
+  sqe->fd = fd;
+  sqe->addr = addr;
+  sqe->len = len;
+  sqe->off = off; // also addr2, linkat's new path
+  sqe->rw_flags = flags; // also hardlink_flags
+  sqe->user_data = (uint64_t)step;
+  fSqArray[idx] = idx;
+  __atomic_store_n(fSqTail, tail + 1, __ATOMIC_RELEASE);
+}
+
+int UringWriter::Submit(const std::vector<std::pair<std::string, std::string>>& targets,
+    std::shared_ptr<std::string> data, std::size_t size, std::function<void(int)> done) {
+  if (fRing < 0 || targets.size() == 0) return -1;
+  int fd = open(targets[0].first.c_str(), O_TMPFILE | O_WRONLY | O_DIRECT | O_CLOEXEC, 0644);
+  if (fd < 0) return -1;
+  std::size_t body = size & ~(kAlign - 1), tail = size - body;
+  auto op = new op_t;
+  op->fd = fd;
+  op->tail_fd = -1;
+  op->buffer = nullptr;
+  op->proc = "/proc/self/fd/" + std::to_string(fd);
+  auto fail = [&]{
+    if (op->tail_fd >= 0) close(op->tail_fd);
+    close(op->fd);
+    ReturnBuffer(op->buffer, op->capacity);
+    delete op;
+    return -1;
+  };
+  // O_DIRECT wants the memory aligned too
+  if ((op->buffer = GetBuffer(body + (tail > 0 ? kAlign : 0), op->capacity)) == nullptr)
+    return fail();
+  std::memcpy(op->buffer, data->data(), size);
+  // the last partial block can't go through O_DIRECT
+  if (tail > 0 && (op->tail_fd = open(op->proc.c_str(), O_WRONLY | O_CLOEXEC)) < 0)
+    return fail();
+  for (auto& [dir, name] : targets) op->paths.push_back(dir + "/" + name);
+  unsigned n = (body > 0) + (tail > 0) + targets.size();
+  if (GetSqes(n)) return fail();
+  op->steps.assign(n, step_t{op, 0, 0});
+  op->done = std::move(done);
+  op->pending = n;
+  unsigned s = 0;
+  if (body > 0) {
+    op->steps[s].expected = body;
+    Push(IORING_OP_WRITE, fd, (uint64_t)op->buffer, body, 0, 0, true, &op->steps[s++]);
+  }
+  if (tail > 0) {
+    op->steps[s].expected = tail;
+    Push(IORING_OP_WRITE, op->tail_fd, (uint64_t)(op->buffer + body), tail, body, 0, true,
+        &op->steps[s++]);
+  }
+  op->writes = s;
+  // each link only starts once everything before it worked
+  Push(IORING_OP_LINKAT, AT_FDCWD, (uint64_t)op->proc.c_str(), AT_FDCWD,
+      (uint64_t)op->paths[0].c_str(), AT_SYMLINK_FOLLOW, s + 1 < n, &op->steps[s]);
+  for (s++; s < n; s++) {
+    Push(IORING_OP_LINKAT, AT_FDCWD, (uint64_t)op->paths[0].c_str(), AT_FDCWD,
+        (uint64_t)op->paths[s - op->writes].c_str(), 0, s + 1 < n, &op->steps[s]);
+  }
+  fInFlight += n;
+  unsigned left = n;
+  while (left > 0) {
+    int ret = syscall(__NR_io_uring_enter, fRing, left, 0, 0, nullptr, 0);
+    if (ret > 0) left -= ret;
+    else if (ret < 0 && errno == EINTR) continue;
+    // short on resources, which only completions give back
+    else if (ret < 0 && (errno == EAGAIN || errno == EBUSY) && fInFlight > (int)left) Reap(true);
+    else break; // 0 or a real error, trying again won't help
+  }
+  if (left == 0) return 0;
+  // the kernel takes them from the head, so what it didn't get is the end of
+  // our chain and nobody else has pushed since
+  __atomic_store_n(fSqTail, *fSqTail - left, __ATOMIC_RELEASE);
+  fInFlight -= left;
+  if (left == n) return fail(); // the caller writes it the usual way
+  // the part that went in finishes as usual, the rest counts as not placed
+  for (unsigned i = n - left; i < n; i++) op->steps[i].res = -ECANCELED;
+  op->pending -= left;
+  if (op->pending == 0) Finish(op);
+  return 0;
+}
+
+int UringWriter::Reap(bool wait) {
+  if (fRing < 0) return 0;
+  std::vector<op_t*> finished;
+  while (true) {
+    unsigned head = *fCqHead;
+    unsigned tail = __atomic_load_n(fCqTail, __ATOMIC_ACQUIRE);
+    if (head == tail) {
+      if (!wait || finished.size() > 0 || fInFlight == 0) break;
+      syscall(__NR_io_uring_enter, fRing, 0, 1, IORING_ENTER_GETEVENTS, nullptr, 0);
+      continue;
+    }
+    for (; head != tail; head++) {
+      auto cqe = &((io_uring_cqe*)fCqes)[head & *fCqMask];
+      auto step = (step_t*)cqe->user_data;
+      step->res = cqe->res;
+      fInFlight--;
+      if (--step->op->pending == 0) finished.push_back(step->op);
+    }
+    __atomic_store_n(fCqHead, head, __ATOMIC_RELEASE);
+  }
+  for (auto op : finished) Finish(op);
+  return finished.size();
+}
+
+#else // no io_uring headers
+
+int UringWriter::Open(unsigned, std::string& error) {
+  error = "built without io_uring";
+  return -1;
+}
+int UringWriter::GetSqes(unsigned) {return -1;}
+void UringWriter::Push(uint8_t, int, uint64_t, uint32_t, uint64_t, uint32_t, bool, step_t*) {}
+int UringWriter::Submit(const std::vector<std::pair<std::string, std::string>>&,
+    std::shared_ptr<std::string>, std::size_t, std::function<void(int)>) {return -1;}
+int UringWriter::Reap(bool) {return 0;}
+
+#endif // REDAX_HAVE_URING
+
+void UringWriter::Finish(op_t* op) {
+  // how far down the chain it got. A failed step cancels the ones after it
+  int placed = 0;
+  bool written = true;
+  for (int i = 0; i < op->writes; i++)
+    written = written && op->steps[i].res == op->steps[i].expected;
+  for (unsigned i = op->writes; written && i < op->steps.size() && op->steps[i].res == 0; i++)
+    placed++;
+  if (op->tail_fd >= 0) close(op->tail_fd);
+  close(op->fd);
+  ReturnBuffer(op->buffer, op->capacity);
+  auto done = std::move(op->done);
+  delete op;
+  done(placed);
+}
+
+void UringWriter::Drain() {
+  while (fInFlight > 0) Reap(true);
+}
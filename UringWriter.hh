@@ -0,0 +1,81 @@
+#ifndef _URINGWRITER_HH_
+#define _URINGWRITER_HH_
+
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <string>
+#include <utility>
+#include <vector>
+
+class UringWriter{
+  /*
+    Asynchronous chunk output through io_uring, for the thread that owns it.
+    A file is written into an unnamed O_TMPFILE with O_DIRECT from an
+    aligned copy of the buffer (so it doesn't go through the page cache the
+    live processing needs), the last partial block through a normal
+    descriptor, and then it gets its name (and any extra names, like _pre)
+    with linkat, all chained in the kernel so the thread only submits and
+    moves on. Completions are picked up by Reap().
+    This is only the fast path: anything out of the ordinary (no O_DIRECT,
+    a file already there, a short write) is handed back through the
+    callback, whose caller does the rest the usual way. Nothing to clean up
+    after a failure, an O_TMPFILE without a name is gone once closed.
+    Talks to the kernel directly (linux/io_uring.h), no liburing needed.
+  */
+public:
+  UringWriter();
+  ~UringWriter(); // waits for whatever is still in flight
+
+  int Open(unsigned depth, std::string& error); // 0 if we can use io_uring
+  bool IsOpen() {return fRing >= 0;}
+
+  // Write data to the first target and link the others to it. targets are
+  // {directory, file name}, the directories have to exist. done(n) runs from
+  // Reap with how many targets (in order) are in place. -1 if nothing was
+  // submitted, the caller does it all itself then
+  int Submit(const std::vector<std::pair<std::string, std::string>>& targets,
+      std::shared_ptr<std::string> data, std::size_t size, std::function<void(int)> done);
+  int Reap(bool wait); // completions handled
+  void Drain();
+  int InFlight() {return fInFlight;}
+
+private:
+  struct op_t;
+  struct step_t {
+    op_t* op;
+    long expected; // result that means it worked
+    int res;
+  };
+  struct op_t {
+    std::vector<step_t> steps;
+    int writes; // the first this many steps are writes
+    int fd, tail_fd;
+    char* buffer;
+    std::size_t capacity;
+    std::string proc; // /proc/self/fd/<fd>, linkat's source
+    std::vector<std::string> paths;
+    std::function<void(int)> done;
+    int pending;
+  };
+
+  int GetSqes(unsigned n);
+  void Push(uint8_t opcode, int fd, uint64_t addr, uint32_t len, uint64_t off, uint32_t flags,
+      bool link, step_t* step);
+  void Finish(op_t* op);
+  char* GetBuffer(std::size_t size, std::size_t& capacity);
+  void ReturnBuffer(char* buffer, std::size_t capacity);
+
+  int fRing;
+  unsigned fEntries;
+  int fInFlight; // sqes submitted and not completed
+  void *fSqRing, *fCqRing, *fSqes;
+  std::size_t fSqRingSize, fCqRingSize, fSqesSize;
+  unsigned *fSqHead, *fSqTail, *fSqMask, *fSqArray;
+  unsigned *fCqHead, *fCqTail, *fCqMask;
+  void* fCqes;
+  // aligned buffers we're done with, since fresh ones cost a page fault every 4k
+  std::vector<std::pair<char*, std::size_t>> fBuffers;
+};
+
+#endif // _URINGWRITER_HH_ defined
@@ -36,6 +36,7 @@ V1724::V1724(std::shared_ptr<MongoLog>& log, std::shared_ptr<Options>& opts, int
   fBaseAddress=address;
   fRolloverCounter = 0;
   fLastClock = 0;
+  fReads = fBLTs = fBytesRead = 0;
   fBLTSafety = opts->GetDouble("blt_safety_factor", 1.5);
   BLT_SIZE = opts->GetInt("blt_size", 512*1024);
   // there's a more elegant way to do this, but I'm not going to write it
@@ -171,7 +172,7 @@ int V1724::GetClockCounter(uint32_t timestamp){
 
   int n_missed = dt / fClockPeriod;
   if (n_missed > 0) {
-    fLog->Entry(MongoLog::Message, "Board %i missed %i rollovers", fBID, n_missed);
+    fLog->LimitedEntry(MongoLog::Message, "Board %i missed %i rollovers", fBID, n_missed);
     fRolloverCounter += n_missed;
   }
 
@@ -241,9 +242,9 @@ int V1724::Read(std::unique_ptr<data_packet>& outptr){
       for (auto& b : xfer_buffers) delete[] b.first;
       return -1;
     }
-    if (nb > BLT_SIZE) fLog->Entry(MongoLog::Message,
+    if (nb > BLT_SIZE) fLog->LimitedEntry(MongoLog::Message,
         "Board %i got %i more bytes than asked for (headroom %i)",
-        fBID, nb-BLT_SIZE, alloc_words*sizeof(char32_t)-nb);
+        fBID, nb-BLT_SIZE, (int)(alloc_words*sizeof(char32_t)-nb));
 
     count++;
     blt_words+=nb/sizeof(char32_t);
@@ -267,6 +268,9 @@ int V1724::Read(std::unique_ptr<data_packet>& outptr){
       s.append(xfer.first, xfer.second);
     }
     fBLTCounter[count]++;
+    fReads++;
+    fBLTs += count;
+    fBytesRead += blt_words*sizeof(char32_t);
     auto [ht, cc] = GetClockInfo(s);
     outptr = std::make_unique<data_packet>(std::move(s), ht, cc);
   }
@@ -13,6 +13,13 @@ class MongoLog;
 class Options;
 class data_packet;
 
+struct readout_stats_t {
+  long reads; // reads that returned data
+  long blts;
+  long bytes;
+  int rollovers;
+};
+
 class V1724{
 
  public:
@@ -33,6 +40,7 @@ class V1724{
   void ClampDACValues(std::vector<uint16_t>&, std::map<std::string, std::vector<double>>&);
   unsigned GetNumChannels() {return fNChannels;}
   int SetThresholds(std::vector<uint16_t> vals);
+  readout_stats_t GetReadoutStats() {return {fReads.load(), fBLTs.load(), fBytesRead.load(), fRolloverCounter};}
 
   virtual std::tuple<int, int, bool, uint32_t> UnpackEventHeader(std::u32string_view);
   virtual std::tuple<int64_t, int, uint16_t, std::u32string_view> UnpackChannelHeader(std::u32string_view, long, uint32_t, uint32_t, int, int);
@@ -73,6 +81,7 @@ protected:
 
   int BLT_SIZE;
   std::map<int, long> fBLTCounter;
+  std::atomic_long fReads, fBLTs, fBytesRead; // also read by the status thread
 
   virtual int Init(int, int, std::shared_ptr<Options>&);
   bool MonitorRegister(uint32_t reg, uint32_t mask, int ntries, int sleep, uint32_t val=1);
@@ -0,0 +1,69 @@
+#ifndef _XXHASH_HH_
+#define _XXHASH_HH_
+
+#include <cstdint>
+#include <cstring>
+#include <cstddef>
+
+// XXH64 (https://github.com/Cyan4973/xxHash), one-shot only. Small enough
+// to carry here instead of adding a dependency, and fast enough to hash
+// every compressed chunk. Output is the same as xxhsum -H64.
+class XXHash{
+public:
+  static uint64_t Hash64(const void* input, std::size_t len, uint64_t seed=0) {
+    const uint8_t* p = (const uint8_t*)input;
+    const uint8_t* end = p + len;
+    uint64_t h;
+    if (len >= 32) {
+      uint64_t v1 = seed + kPrime1 + kPrime2, v2 = seed + kPrime2, v3 = seed, v4 = seed - kPrime1;
+      for (; p + 32 <= end; p += 32) {
+        v1 = Round(v1, Read64(p));
+        v2 = Round(v2, Read64(p+8));
+        v3 = Round(v3, Read64(p+16));
+        v4 = Round(v4, Read64(p+24));
+      }
+      h = Rotl(v1, 1) + Rotl(v2, 7) + Rotl(v3, 12) + Rotl(v4, 18);
+      h = Merge(h, v1);
+      h = Merge(h, v2);
+      h = Merge(h, v3);
+      h = Merge(h, v4);
+    } else {
+      h = seed + kPrime5;
+    }
+    h += len;
+    for (; p + 8 <= end; p += 8)
+      h = Rotl(h ^ Round(0, Read64(p)), 27)*kPrime1 + kPrime4;
+    if (p + 4 <= end) {
+      h = Rotl(h ^ (Read32(p)*kPrime1), 23)*kPrime2 + kPrime3;
+      p += 4;
+    }
+    for (; p < end; p++)
+      h = Rotl(h ^ (*p*kPrime5), 11)*kPrime1;
+    h ^= h >> 33;
+    h *= kPrime2;
+    h ^= h >> 29;
+    h *= kPrime3;
+    h ^= h >> 32;
+    return h;
+  }
+
+private:
+  static constexpr uint64_t kPrime1 = 0x9E3779B185EBCA87ULL;
+  static constexpr uint64_t kPrime2 = 0xC2B2AE3D27D4EB4FULL;
+  static constexpr uint64_t kPrime3 = 0x165667B19E3779F9ULL;
+  static constexpr uint64_t kPrime4 = 0x85EBCA77C2B2AE63ULL;
+  static constexpr uint64_t kPrime5 = 0x27D4EB2F165667C5ULL;
+
+  // little-endian, which is all we run on
+  static uint64_t Read64(const uint8_t* p) {uint64_t v; std::memcpy(&v, p, 8); return v;}
+  static uint64_t Read32(const uint8_t* p) {uint32_t v; std::memcpy(&v, p, 4); return v;}
+  static uint64_t Rotl(uint64_t x, int r) {return (x << r) | (x >> (64 - r));}
+  static uint64_t Round(uint64_t acc, uint64_t input) {
+    return Rotl(acc + input*kPrime2, 31)*kPrime1;
+  }
+  static uint64_t Merge(uint64_t h, uint64_t v) {
+    return (h ^ Round(0, v))*kPrime1 + kPrime4;
+  }
+};
+
+#endif // _XXHASH_HH_ defined
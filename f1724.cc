@@ -110,11 +110,13 @@ unsigned int f1724::ReadRegister(unsigned int) {
 
 int f1724::Read(std::unique_ptr<data_packet>& outptr) {
   if (fBufferSize == 0) return 0;
-  const std::lock_guard<std::mutex> lk(fBufferMutex);
+  const std::lock_guard<NamedMutex> lk(fBufferMutex);
   int retwords = fBuffer.size();
   auto [ht, cc] = GetClockInfo(fBuffer);
   outptr = std::make_unique<data_packet>(std::move(fBuffer), ht, cc);
   fBufferSize = 0;
+  fReads++;
+  fBytesRead += retwords*sizeof(char32_t);
   return retwords;
 }
 
@@ -195,7 +197,7 @@ int f1724::AcquisitionStop(bool i_mean_it) {
 }
 
 int f1724::Reset() {
-  const std::lock_guard<std::mutex> lg(fBufferMutex);
+  const std::lock_guard<NamedMutex> lg(fBufferMutex);
   fBuffer.clear();
   fEventCounter = 0;
   fBufferSize = 0;
@@ -391,7 +393,7 @@ void f1724::ConvertToDigiFormat(const vector<vector<double>>& wf, int mask, long
     } // loop over samples
   } // loop over channels
   {
-    const std::lock_guard<std::mutex> lg(fBufferMutex);
+    const std::lock_guard<NamedMutex> lg(fBufferMutex);
     fBuffer.append(buffer);
     fBufferSize = fBuffer.size();
   }
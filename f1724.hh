@@ -3,6 +3,7 @@
 
 #include "V1724.hh"
 #include "Options.hh"
+#include "NamedMutex.hh"
 #include <random>
 #include <tuple>
 #include <mutex>
@@ -75,7 +76,7 @@ protected:
   void ReceiveFromGenerator(std::vector<hit_t>, long);
 
   std::u32string fBuffer;
-  std::mutex fBufferMutex;
+  NamedMutex fBufferMutex{"fax_buffer"};
   std::atomic_int fBufferSize;
   std::random_device fRD;
   std::mt19937_64 fGen;
@@ -0,0 +1,69 @@
+#include "MongoLog.hh"
+#include <iostream>
+#include <iomanip>
+#include <chrono>
+#include <thread>
+#include <vector>
+#include <cstdio>
+#include <cstdlib>
+
+// What a MongoLog::Entry costs the calling thread, for each formatting path,
+// next to what the caller used to do (two vsnprintf, a vector and a string
+// per entry). Messages go to a sink that throws them away, so this is only
+// the caller's side; the writer thread does the rest.
+// ./log-bench [entries per case]
+
+// How Entry used to format, before the thread-local buffer and the deferred path
+int OldEntry(std::shared_ptr<MongoLog>& log, int priority, const char* format, ...) {
+  va_list args;
+  va_start(args, format);
+  std::size_t len = std::vsnprintf(NULL, 0, format, args);
+  va_end(args);
+  std::vector<char> vec(len + 1);
+  va_start(args, format);
+  std::vsnprintf(&vec[0], len + 1, format, args);
+  va_end(args);
+  return log->Entry(priority, std::string(&vec[0]));
+}
+
+int main(int argc, char** argv) {
+  long n = argc > 1 ? std::atol(argv[1]) : 1000000;
+  const int batch = 1000; // well under the ring size, so nothing is dropped
+  std::vector<std::unique_ptr<LogSink>> sinks;
+  sinks.emplace_back(std::make_unique<NullSink>());
+  auto log = std::make_shared<MongoLog>(sinks);
+
+  auto run = [&](const char* name, auto&& entry) {
+    double ns = 0;
+    long dropped = log->GetDropped();
+    for (long done = 0; done < n; done += batch) {
+      auto start = std::chrono::steady_clock::now();
+      for (int i = 0; i < batch; i++) entry(done + i);
+      ns += std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count();
+      // let the writer catch up, it's not what we're timing
+      std::this_thread::sleep_for(std::chrono::milliseconds(2));
+    }
+    std::cout << std::left << std::setw(32) << name << std::right << std::setw(8) <<
+      std::fixed << std::setprecision(0) << ns/n << " ns/entry";
+    if (log->GetDropped() > dropped) std::cout << " (" << log->GetDropped() - dropped << " dropped)";
+    std::cout << '\n';
+  };
+
+  log->SetRateLimit(0, 10);
+  run("Local, old", [&](long i) {
+    OldEntry(log, MongoLog::Local, "Board %i rollover %i (%x/%x)", 100, int(i), 0x7fff0000, int(i));});
+  run("Local, deferred", [&](long i) {
+    log->Entry(MongoLog::Local, "Board %i rollover %i (%x/%x)", 100, int(i), 0x7fff0000, int(i));});
+  run("Local with a string, old", [&](long i) {
+    OldEntry(log, MongoLog::Local, "Using default value for %s (%li)", "strax_chunk_length", i);});
+  run("Local with a string, deferred", [&](long i) {
+    log->Entry(MongoLog::Local, "Using default value for %s (%li)", "strax_chunk_length", i);});
+  run("Message, old", [&](long i) {
+    OldEntry(log, MongoLog::Message, "Board %i missed %i rollovers", 100, int(i));});
+  run("Message, thread-local buffer", [&](long i) {
+    log->Entry(MongoLog::Message, "Board %i missed %i rollovers", 100, int(i));});
+  log->SetRateLimit(1, 3600);
+  run("Message, rate-limited away", [&](long i) {
+    log->LimitedEntry(MongoLog::Message, "Board %i missed %i rollovers", 100, int(i));});
+  return 0;
+}
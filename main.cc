@@ -5,6 +5,7 @@
 #include <thread>
 #include <unistd.h>
 #include "MongoLog.hh"
+#include "MongoSink.hh"
 #include "Options.hh"
 #include <chrono>
 #include <thread>
@@ -29,22 +30,51 @@ void SignalHandler(int signum) {
     return;
 }
 
+bool UseTimeSeries(mongocxx::database& db, const std::string& name) {
+  // a time-series collection if the server can do them, otherwise a plain one
+  using namespace bsoncxx::builder::stream;
+  try{
+    for (auto doc : db.list_collections(document{} << "name" << name << finalize))
+      return doc["type"] && doc["type"].get_utf8().value.to_string() == "timeseries";
+    db.create_collection(name, document{} << "timeseries" << open_document <<
+        "timeField" << "time" << "metaField" << "host" << "granularity" << "seconds" <<
+        close_document << finalize);
+    return true;
+  }catch(const std::exception &e){
+    std::cout<<"No time-series collection for "<<name<<": "<<e.what()<<std::endl;
+  }
+  return false;
+}
+
 void UpdateStatus(std::shared_ptr<mongocxx::pool> pool, std::string dbname,
-    std::unique_ptr<DAQController>& controller) {
+    std::unique_ptr<DAQController>& controller, int sample_rate, int flush_period) {
   using namespace std::chrono;
   auto client = pool->acquire();
   auto db = (*client)[dbname];
   auto collection = db["status"];
-  while (b_run == true) {
-    auto start = std::chrono::system_clock::now();
+  bool timeseries = UseTimeSeries(db, "status_history");
+  auto history = db["status_history"];
+  // counters get sampled at sample_rate, the usual status doc goes out once a
+  // second, and the history gets flushed every flush_period seconds
+  auto period = microseconds(1000000/sample_rate);
+  int samples_per_flush = sample_rate*flush_period;
+  controller->SetRateHistory(2*samples_per_flush);
+  auto next = steady_clock::now();
+  for (long tick = 1; b_run == true; tick++) {
+    controller->SampleCounters();
     try{
-      controller->StatusUpdate(&collection);
+      if (tick % sample_rate == 0)
+        controller->StatusUpdate(&collection);
+      if (tick % samples_per_flush == 0)
+        controller->FlushRateHistory(&history, timeseries);
     }catch(const std::exception &e){
       std::cout<<"Can't connect to DB to update."<<std::endl;
       std::cout<<e.what()<<std::endl;
     }
-    auto end = std::chrono::system_clock::now();
-    std::this_thread::sleep_for(seconds(1)-(end-start));
+    next += period;
+    auto now = steady_clock::now();
+    if (next < now) next = now; // don't try to catch up
+    std::this_thread::sleep_until(next);
   }
   std::cout<<"Status update returning\n";
 }
@@ -59,6 +89,10 @@ int PrintUsage() {
     << "--cc: this instance is a crate controller\n"
     << "--arm-delay <delay>: ms to wait between the ARM command and the arming sequence, default 5000\n"
     << "--log-retention <value>: how many days to keep logfiles, default 7\n"
+    << "--log-sinks <list>: comma-separated list of where logs go (mongo, file, memory, null), default \"file,mongo\"\n"
+    << "--status-rate <Hz>: how often to sample the rate counters, default 10\n"
+    << "--status-flush <seconds>: how often to upload the sampled rates, default 10\n"
+    << "--metrics <[host]:port>: serve Prometheus metrics over HTTP here, default off\n"
     << "--help: print this message\n"
     << "\n";
   return 1;
@@ -76,6 +110,9 @@ int main(int argc, char** argv){
   std::string dbname = "daq", suri = "", sid = "";
   bool reader = false, cc = false;
   int log_retention = 7; // days
+  std::string log_sinks = "file,mongo";
+  std::string metrics_address = "";
+  int status_rate = 10, status_flush = 10;
   int c(0), opt_index, delay(15000);
   struct option longopts[] = {
     {"id", required_argument, 0, c++},
@@ -86,6 +123,10 @@ int main(int argc, char** argv){
     {"cc", no_argument, 0, c++},
     {"arm-delay", required_argument, 0, c++},
     {"log-retention", required_argument, 0, c++},
+    {"log-sinks", required_argument, 0, c++},
+    {"status-rate", required_argument, 0, c++},
+    {"status-flush", required_argument, 0, c++},
+    {"metrics", required_argument, 0, c++},
     {"help", no_argument, 0, c++}
   };
   while ((c = getopt_long(argc, argv, "", longopts, &opt_index)) != -1) {
@@ -107,12 +148,24 @@ int main(int argc, char** argv){
       case 7:
         log_retention = std::stoi(optarg); break;
       case 8:
+        log_sinks = optarg; break;
+      case 9:
+        status_rate = std::stoi(optarg); break;
+      case 10:
+        status_flush = std::stoi(optarg); break;
+      case 11:
+        metrics_address = optarg; break;
+      case 12:
       default:
         std::cout<<"Received unknown arg\n";
         return PrintUsage();
     }
   }
   if (suri == "" || sid == "") return PrintUsage();
+  if (status_rate < 1 || status_rate > 1000 || status_flush < 1) {
+    std::cout<<"Status sampling rate must be 1-1000 Hz and the flush period at least 1 s\n";
+    return 1;
+  }
   if (reader == cc) {
     std::cout<<"Specify --reader XOR --cc\n";
     return 1;
@@ -136,7 +189,23 @@ int main(int argc, char** argv){
   mongocxx::collection opts_collection = db["options"];
 
   // Logging
-  auto fLog = std::make_shared<MongoLog>(log_retention, pool, dbname, log_dir, hostname);
+  std::vector<std::unique_ptr<LogSink>> sinks;
+  std::stringstream ss(log_sinks);
+  for (std::string sink; std::getline(ss, sink, ',');) {
+    if (sink == "mongo")
+      sinks.emplace_back(std::make_unique<MongoSink>(pool, dbname, hostname));
+    else if (sink == "file")
+      sinks.emplace_back(std::make_unique<FileSink>(log_dir, hostname, log_retention));
+    else if (sink == "memory")
+      sinks.emplace_back(std::make_unique<MemorySink>());
+    else if (sink == "null")
+      sinks.emplace_back(std::make_unique<NullSink>());
+    else {
+      std::cout<<"Unknown log sink "<<sink<<std::endl;
+      return PrintUsage();
+    }
+  }
+  auto fLog = std::make_shared<MongoLog>(sinks);
 
   //Options
   std::shared_ptr<Options> fOptions;
@@ -148,7 +217,13 @@ int main(int argc, char** argv){
     controller = std::make_unique<CControl_Handler>(fLog, hostname);
   else
     controller = std::make_unique<DAQController>(fLog, hostname);
-  std::thread status_update(&UpdateStatus, pool, dbname, std::ref(controller));
+  controller->SetLogDir(log_dir);
+  if (metrics_address != "" && controller->ServeMetrics(metrics_address)) {
+    std::cout<<"Can't serve metrics on "<<metrics_address<<std::endl;
+    return 1;
+  }
+  std::thread status_update(&UpdateStatus, pool, dbname, std::ref(controller),
+      status_rate, status_flush);
 
   using namespace bsoncxx::builder::stream;
   // Sort oldest to newest
@@ -188,7 +263,7 @@ int main(int argc, char** argv){
 	      continue;
 	    }
             auto now = system_clock::now();
-            fLog->Entry(MongoLog::Local, "Ack to start took %i us",
+            fLog->Entry(MongoLog::Local, "Ack to start took %li us",
                 duration_cast<microseconds>(now-ack_time).count());
 	  }
 	  else
@@ -199,7 +274,7 @@ int main(int argc, char** argv){
 	    fLog->Entry(MongoLog::Error,
 			  "DAQ failed to stop. Will continue clearing program memory.");
           auto now = system_clock::now();
-          fLog->Entry(MongoLog::Local, "Ack to stop took %i us",
+          fLog->Entry(MongoLog::Local, "Ack to stop took %li us",
               duration_cast<microseconds>(now-ack_time).count());
           fLog->SetRunId(-1);
           fOptions.reset();
@@ -0,0 +1,141 @@
+#include "SharedMetrics.hh"
+#include <iostream>
+#include <iomanip>
+#include <sstream>
+#include <thread>
+#include <chrono>
+#include <vector>
+#include <map>
+#include <ctime>
+#include <csignal>
+#include <cstdlib>
+#include <atomic>
+#include <algorithm>
+#include <dirent.h>
+#include <unistd.h>
+#include <signal.h>
+
+// Watch a running reader through its shared-memory metrics, like top.
+// Doesn't touch the database or the DAQ process beyond mapping the segment.
+
+std::atomic_bool b_run = true;
+
+void SignalHandler(int) {
+  b_run = false;
+}
+
+std::vector<std::string> FindSegments() {
+  std::vector<std::string> ret;
+  DIR* dir = opendir("/dev/shm");
+  if (dir == nullptr) return ret;
+  while (struct dirent* e = readdir(dir)) {
+    std::string name(e->d_name);
+    if (name.rfind("redax_", 0) == 0) ret.push_back(name.substr(6));
+  }
+  closedir(dir);
+  return ret;
+}
+
+const char* StatusName(int status) {
+  const char* names[] = {"Idle", "Arming", "Armed", "Running", "Error", "Unknown"};
+  return names[status >= 0 && status < 5 ? status : 5];
+}
+
+void Render(const std::string& host, int pid, const metrics_t& now, const metrics_t& prev) {
+  double dt = (now.time_ns - prev.time_ns)/1e9;
+  auto rate = [&](int64_t a, int64_t b) {return dt > 0 && a >= b ? (a - b)/dt : 0.;};
+  std::stringstream ss;
+  ss << std::fixed << std::setprecision(1);
+  std::time_t t = now.time_ns/1000000000;
+  char buf[32];
+  std::strftime(buf, sizeof(buf), "%H:%M:%S", std::localtime(&t));
+  bool alive = kill(pid, 0) == 0;
+  ss << "\033[H\033[J" << host << " (pid " << pid << (alive ? "" : ", gone") << ")  " << buf <<
+    "  status " << StatusName(now.status) << "  run " << now.run << '\n';
+  ss << "log: " << now.log_dropped << " dropped, " << now.log_suppressed << " suppressed\n\n";
+
+  ss << std::setw(6) << "link" << std::setw(8) << "boards" << std::setw(10) << "MB/s"
+    << std::setw(11) << "throttles" << std::setw(12) << "throttled s" << '\n';
+  double total = 0;
+  for (int i = 0; i < now.n_links && i < kMetricsMaxLinks; i++) {
+    auto& l = now.links[i];
+    double r = i < prev.n_links && prev.links[i].link == l.link ? rate(l.bytes, prev.links[i].bytes) : 0;
+    total += r;
+    ss << std::setw(6) << l.link << std::setw(8) << l.boards << std::setw(10) << r/1e6
+      << std::setw(11) << l.throttle_events << std::setw(12) << l.throttle_ns/1e9
+      << (l.throttled ? "  PAUSED" : "") << '\n';
+  }
+  ss << std::setw(14) << "total" << std::setw(10) << total/1e6 << "\n\n";
+
+  ss << std::setw(6) << "thread" << std::setw(11) << "queue MB" << std::setw(11) << "spill MB"
+    << std::setw(11) << "output MB" << std::setw(8) << "CPU %" << '\n';
+  for (int i = 0; i < now.n_formatters && i < kMetricsMaxFormatters; i++) {
+    auto& f = now.formatters[i];
+    double cpu = i < prev.n_formatters ? rate(f.cpu_ns, prev.formatters[i].cpu_ns)/1e7 : 0;
+    ss << std::setw(6) << i << std::setw(11) << f.input_bytes/1e6 << std::setw(11)
+      << f.spill_bytes/1e6 << std::setw(11) << f.output_bytes/1e6 << std::setw(8) << cpu << '\n';
+  }
+  ss << '\n';
+
+  ss << std::setw(6) << "board" << std::setw(6) << "link" << std::setw(10) << "MB/s"
+    << std::setw(10) << "reads/s" << std::setw(10) << "BLT/s" << '\n';
+  for (int i = 0; i < now.n_boards && i < kMetricsMaxBoards; i++) {
+    auto& b = now.boards[i];
+    bool same = i < prev.n_boards && prev.boards[i].bid == b.bid;
+    ss << std::setw(6) << b.bid << std::setw(6) << b.link
+      << std::setw(10) << (same ? rate(b.bytes, prev.boards[i].bytes)/1e6 : 0.)
+      << std::setw(10) << (same ? rate(b.reads, prev.boards[i].reads) : 0.)
+      << std::setw(10) << (same ? rate(b.blts, prev.boards[i].blts) : 0.) << '\n';
+  }
+  std::cout << ss.str() << std::flush;
+}
+
+int main(int argc, char** argv) {
+  std::string host;
+  double hz = 10;
+  int c;
+  while ((c = getopt(argc, argv, "r:h")) != -1) {
+    if (c == 'r') {
+      hz = std::max(std::atof(optarg), 0.1);
+    } else {
+      std::cout << "Usage: redax-top [-r <Hz>] [<id>]\n"
+        << "Shows the live counters of the reader with the given id (the --id it runs with),\n"
+        << "or of the only one running on this machine. Updates 10 times a second by default.\n";
+      return c == 'h' ? 0 : 1;
+    }
+  }
+  if (optind < argc) {
+    host = argv[optind];
+  } else {
+    auto found = FindSegments();
+    if (found.size() != 1) {
+      std::cout << (found.size() == 0 ? "No redax processes found" : "Which one?") << '\n';
+      for (auto& h : found) std::cout << "  " << h << '\n';
+      return 1;
+    }
+    host = found[0];
+  }
+  SharedMetrics metrics(host, false);
+  if (!metrics.IsOpen()) {
+    std::cout << "Can't open metrics: " << metrics.Error() << '\n';
+    return 1;
+  }
+  std::signal(SIGINT, SignalHandler);
+  std::signal(SIGTERM, SignalHandler);
+  metrics_t now{}, last{}, prev{};
+  auto period = std::chrono::microseconds(long(1e6/hz));
+  auto next = std::chrono::steady_clock::now();
+  while (b_run) {
+    if (metrics.Read(now)) {
+      // rates are between the last two updates from the writer
+      if (now.time_ns != last.time_ns) {
+        prev = last;
+        last = now;
+      }
+      Render(host, metrics.Pid(), last, prev);
+    }
+    next += period;
+    std::this_thread::sleep_until(next);
+  }
+  return 0;
+}